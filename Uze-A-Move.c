@@ -20,7 +20,10 @@
 #include <avr/io.h>
 #include <stdlib.h>
 #include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <string.h>
 #include <uzebox.h>
+#include "board.h"
 
 typedef enum {
 	C_BLANK = 0,
@@ -81,8 +84,10 @@ typedef enum {
 #include "data/sprites.inc"
 #include "data/title.inc"
 #include "data/patches.inc"
-#include "data/title_song.inc"
+#include "data/title_music.inc"
+#include "data/demos.inc"
 #define FIRST_TEXT_TILE		1
+#define TEXT_DIGIT_TILE		(FIRST_TEXT_TILE+1)
 
 #define FIELD_BUBBLES_H		8
 #define FIELD_BUBBLES_V		11
@@ -91,38 +96,22 @@ typedef enum {
 #define NUM_BUBBLES			(8*6)+(7*6)
 #define BUBBLE_ROWS			FIELD_TILES_V
 #define GEAR_ANIM_STEPS 	2
+// Rows filled at the start of a game.
+#define START_ROWS			5
 
-// Pre-calcutated co-ordinates of arrow parts
-#define ANGLES 30
-const char arrow_x[ANGLES] PROGMEM = {
-	 0,  1,  3,  5,  7,  8,  9, 10, 12, 13, 14, 15, 16, 17, 18,
-	19, 20, 21, 22, 23, 24, 24, 25, 25, 26, 26, 27, 27, 28, 28 };
-const char arrow_y[ANGLES] PROGMEM = {
-	31, 31, 31, 31, 31, 30, 30, 30, 29, 29, 28, 28, 26, 26,	24,
-	23, 22, 22, 21, 20, 19, 18, 17, 15, 14, 13, 11, 10,  8,  6 };
-	
-const char ring_x[ANGLES] PROGMEM = {
-	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 13,
-	14, 15, 16, 16, 17, 17, 18, 18, 19, 19, 19, 20, 20, 20, 20 };
-const char ring_y[ANGLES] PROGMEM = {
-	20, 20, 20, 20, 20, 19, 19, 19, 18, 18, 17, 17, 16, 16, 15,
-	14, 13, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1 };
-
-const char rivet_x[ANGLES] PROGMEM = {
-	 0,  1,  1,  2,  3,  4,  4,  5,  6,  6,  7,  8,  8,  9,  9,
-	10, 10, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 14, 14 };
-const char rivet_y[ANGLES] PROGMEM = {
-	14, 14, 14, 14, 14, 14, 13, 13, 13, 12, 12, 12, 11, 11, 10,
-	10,  9,  9,  8,  8,  7,  6,  6,  5,  4,  4,  3,  2,  1,  1 };
-
-// Same for projectile paths, but mutiplied by a trajectory factor.
-#define TRAJ_SHIFT 4
-const char traj_x[ANGLES] PROGMEM = {
-	 0,  3,  5,  8, 10, 12, 15, 17, 20, 22, 24, 26, 28, 30, 32,
-	34, 36, 37, 39, 40, 42, 43, 44, 45, 46, 46, 47, 47, 48, 48 };
-const char traj_y[ANGLES] PROGMEM = {
-	48, 48, 48, 47, 47, 46, 46, 45, 44, 43, 42, 40, 39, 37, 36,
-	34, 32, 30, 28, 26, 24, 22, 20, 17, 15, 12, 10,  8,  5,  3 };
+// Pre-calculated co-ordinates of arrow parts and projectile steps for each
+// angle, generated by tools/aimgen along with ANGLES and TRAJ_SHIFT. Set
+// ANGLES, TRAJ_SHIFT and SHOT_SPEED on the make command line to change them.
+typedef struct {
+	unsigned char frame;
+	unsigned char arrow_x, arrow_y;
+	unsigned char ring_x, ring_y;
+	unsigned char rivet_x, rivet_y;
+} aim_t;
+typedef struct {
+	unsigned char x, y;
+} traj_t;
+#include "data/aim.inc"
 
 // Sprite constants/macros
 #define TILE_ARROW		23
@@ -137,6 +126,12 @@ const char traj_y[ANGLES] PROGMEM = {
 #define SPRITE_RIVET		4
 #define SPRITE_PROJ_L		6
 #define SPRITE_PROJ_R		8
+#define SPRITE_PARTICLE		10
+#define PARTICLE_SPRITES	6
+// Number of logical sprites handled by the sprite manager.
+#define OBJECTS				(SPRITE_PARTICLE+PARTICLE_SPRITES)
+// Sprites at this position are not drawn by the kernel.
+#define SPRITE_HIDDEN_X		(SCREEN_TILES_H*TILE_WIDTH)
 
 // Macros for common calculations
 #define ROW_WIDTH(r)		((r)&1 ? 7 : 8)
@@ -154,30 +149,274 @@ typedef struct {
 // Globals
 #define PLAYERS 2
 unsigned char players = 1;
-unsigned char bubbles[PLAYERS][NUM_BUBBLES];
-unsigned char current[PLAYERS];
-unsigned char next[PLAYERS];
-char angle[PLAYERS];
-projectile_t proj[PLAYERS];
-bool firing[PLAYERS];
-unsigned char block_left[PLAYERS];
-unsigned char block_right[PLAYERS];
-bool block_fire[PLAYERS];
 #define POP_SPEED 15
-unsigned char popping[PLAYERS];
-long score[PLAYERS];
+#define REPEAT_DELAY 5
+// Versus mode: popping GARBAGE_MATCHES or more bubbles at once pushes the
+// opponent's field down by two rows (one pair) per GARBAGE_PER_PAIR extras.
+#define GARBAGE_MATCHES		5
+#define GARBAGE_PER_PAIR	2
+#define GARBAGE_MAX			3
+#define GARBAGE_BUBBLES		(8+7)
+// Bubbles shown coming up: the first in the NEXT slot, the rest stacked
+// above it just outside the field.
+#define NEXT_QUEUE			3
+// Everything belonging to one player, passed around by pointer so the
+// per-player routines index a single base address instead of a separate
+// array for each field.
+typedef struct {
+	unsigned char index;
+	unsigned char bubbles[NUM_BUBBLES];
+	unsigned char current;
+	// Coming up after current, soonest first.
+	unsigned char queue[NEXT_QUEUE];
+	// Colours left to deal before the bag is refilled, bit (colour-1).
+	unsigned char bag;
+	// Bubbles of each colour on the field, not counting any popping.
+	unsigned char colour_count[C_COUNT];
+	char angle;
+	projectile_t proj;
+	bool firing;
+	bool block_fire;
+	unsigned char garbage;
+	long score;
+	// Buttons held for the current game tick.
+	int pad;
+} player_t;
+player_t player_ctx[PLAYERS];
+// Set while re-running rolled back ticks: the game logic runs as usual, but
+// nothing is drawn or played.
+bool quiet = false;
 unsigned int frame = 0;
+// Our own random number state, so that it can be saved with the game.
+unsigned long rng_state = 1;
 // For 1-player game only.
 #define WOBBLE_SECONDS	5
 #define WOBBLE_DELAY	(30*FPS*2)
-int wobble_timer;
+unsigned char wobble_second;
+unsigned char wobble_count;
 unsigned char drop;
 
+// Timer wheel. Every timed event has a fixed timer id and a due tick, and is
+// chained into the wheel slot for that tick, so each tick only the timers in
+// one slot are looked at. Game code sets timers and then just checks whether
+// they're running or have fired.
+#define WHEEL_SLOTS		16
+#define TIMER_NONE		0xff
+typedef enum {
+	TIMER_POP = 0,						// Pop animation, one per player
+	TIMER_LEFT = TIMER_POP+PLAYERS,		// Auto-repeat, one per player
+	TIMER_RIGHT = TIMER_LEFT+PLAYERS,
+	TIMER_WOBBLE = TIMER_RIGHT+PLAYERS,
+	TIMER_GAME_COUNT,					// Timers above are saved in snapshots
+	TIMER_SHINE = TIMER_GAME_COUNT,
+	TIMER_BLINK,
+	TIMERS
+} timer_id_t;
+// Timers whose duration follows the difficulty setting.
+#define TIMER_SCALED_MASK	(1<<TIMER_WOBBLE)
+unsigned int timer_due[TIMERS];
+unsigned char timer_chain[TIMERS];
+unsigned char wheel[WHEEL_SLOTS];
+unsigned int timers_running;
+unsigned int timers_fired;
+unsigned int timer_now;
+bool timers_paused = false;
+// Duration of scaled timers, in 16ths.
+unsigned char timer_scale = 16;
+
+// Where the game wants each sprite across the screen. The game sets y and
+// tileIndex in the kernel's table directly; sprite_commit() hands over x
+// once per frame, for the sprites that fit the RAM tile budget.
+unsigned char object_x[OBJECTS];
+unsigned char ram_tiles_used;
+unsigned char ram_tiles_peak;
+unsigned int sprites_dropped;
+unsigned char sprite_mux;
+
+// Optional on-screen counters, build with "make PROFILE=1".
+#ifndef PROFILE
+#define PROFILE 0
+#endif
+#define PROF_Y 0
+#if PROFILE
+// Input latency: bucket n counts presses that were shown n+1 fields after
+// the vsync that latched them, i.e. whose effect was handed to the kernel n
+// fields late. The last bucket collects anything slower. Each player has
+// one sample in flight, and only presses on this console's pads that
+// visibly did something are timed.
+#define LATENCY_BUCKETS 7
+#define LATENCY_Y (SCREEN_TILES_V-1)
+unsigned int latency_hist[LATENCY_BUCKETS];
+// Every vsync, counted by sound_tick(), so frames that overran are seen.
+volatile unsigned char vsync_count;
+// The vsync that latched the pads now being played, and which players'
+// pads are read on this console.
+unsigned char pad_latched;
+unsigned char pad_local;
+unsigned char latency_seen[PLAYERS];
+bool latency_pending[PLAYERS];
+int pad_last[PLAYERS];
+// Sound effects dropped and voices stolen, see fx_commit().
+unsigned int fx_dropped_total;
+unsigned int fx_stolen_total;
+#endif
+// Linked versus play over the UART, build with "make LINK=1".
+#ifndef LINK
+#define LINK 0
+#endif
+
+// Pop particles, kept as separate arrays so each pass only touches the
+// fields it needs. Velocities are in 1/16ths of a pixel; positions are
+// whole pixels, with the sixteenths of x and y sharing a byte in part_frac.
+#define PARTICLES			8
+#define PARTICLE_SHIFT		4
+#define PARTICLE_LIFE		40
+#define PARTICLE_GRAVITY	3
+// Most particles moved per frame. If more are alive they take turns, so a
+// big pile-up slows the debris down rather than the game.
+#define PARTICLE_UPDATE_CAP	6
+unsigned char part_x[PARTICLES];
+unsigned char part_y[PARTICLES];
+unsigned char part_frac[PARTICLES];
+signed char part_dx[PARTICLES];
+signed char part_dy[PARTICLES];
+unsigned char part_life[PARTICLES];
+unsigned char part_tile[PARTICLES];
+unsigned char part_update_next;
+unsigned char part_draw_next;
+unsigned char particles_live;
+unsigned int particles_dropped;
+
+// Field rows waiting to be drawn, bit y for bubble row y. A full field
+// redraw is most of a frame's spare time, so at most FIELD_ROW_BUDGET rows
+// are drawn between vsyncs and the rest are carried over.
+#define FIELD_ROW_BUDGET	FIELD_TILES_V
+unsigned int field_dirty[PLAYERS];
+unsigned char field_rows_left = FIELD_ROW_BUDGET;
+// Frames that ran out of time with field rows still queued.
+unsigned int field_deferrals;
+
+// High score table, saved to EEPROM blocks in the kernel's format. The table
+// is written to each of HISCORE_SLOTS blocks in turn and the newest one with
+// a good checksum wins on loading, so an interrupted write loses at most the
+// latest update.
+#define HISCORE_ENTRIES		4
+#define HISCORE_NAME_LEN	3
+#define HISCORE_SLOTS		2
+#define HISCORE_BLOCK_ID	0x55a0
+#ifndef EEPROM_BLOCK_SIZE
+#define EEPROM_BLOCK_SIZE	32
+#endif
+#define EEPROM_BLOCKS		((E2END+1)/EEPROM_BLOCK_SIZE)
+typedef struct {
+	char name[HISCORE_NAME_LEN];
+	long score;
+} hiscore_t;
+// Must fit the 30 data bytes of a struct EepromBlockStruct.
+typedef struct {
+	unsigned char seq;
+	hiscore_t entry[HISCORE_ENTRIES];
+	unsigned char checksum;
+} hiscore_table_t;
+hiscore_table_t hiscores;
+// EEPROM address of each slot's block, 0 if unavailable.
+unsigned int hiscore_addr[HISCORE_SLOTS];
+unsigned char hiscore_slot;
+// Next byte to be written to EEPROM, sizeof(hiscores) when idle.
+unsigned char hiscore_pos = sizeof(hiscore_table_t);
+
 typedef enum {
 	ALIGN_LEFT=0,
 	ALIGN_RIGHT
 } align_t;
 
+void timer_unlink( unsigned char id ) {
+	unsigned char *t = &wheel[timer_due[id] & (WHEEL_SLOTS-1)];
+
+	while( *t != TIMER_NONE ) {
+		if( *t == id ) {
+			*t = timer_chain[id];
+			break;
+		}
+		t = &timer_chain[*t];
+	}
+}
+
+void timers_reset( void ) {
+	unsigned char i;
+
+	for( i=0 ; i < WHEEL_SLOTS ; i++ ) {
+		wheel[i] = TIMER_NONE;
+	}
+	timers_running = timers_fired = 0;
+}
+
+void timer_cancel( unsigned char id ) {
+	if( timers_running & (1<<id) ) {
+		timer_unlink( id );
+		timers_running &= ~(1<<id);
+	}
+	timers_fired &= ~(1<<id);
+}
+
+void timer_arm( unsigned char id, unsigned int ticks ) {
+	// Fire "ticks" ticks from now (at least one), replacing any earlier setting.
+	unsigned char slot;
+
+	timer_cancel( id );
+	if( ticks == 0 ) ticks = 1;
+
+	timer_due[id] = timer_now + ticks;
+	slot = timer_due[id] & (WHEEL_SLOTS-1);
+	timer_chain[id] = wheel[slot];
+	wheel[slot] = id;
+	timers_running |= (1<<id);
+}
+
+void timer_set( unsigned char id, unsigned int ticks ) {
+	if( TIMER_SCALED_MASK & (1<<id) ) {
+		ticks = ((unsigned long)ticks * timer_scale) >> 4;
+	}
+	timer_arm( id, ticks );
+}
+
+bool timer_running( unsigned char id ) {
+	return (timers_running & (1<<id)) != 0;
+}
+
+bool timer_fired( unsigned char id ) {
+	// True once after the timer has expired.
+	if( timers_fired & (1<<id) ) {
+		timers_fired &= ~(1<<id);
+		return true;
+	}
+	return false;
+}
+
+unsigned int timer_remaining( unsigned char id ) {
+	return timer_running( id ) ? timer_due[id] - timer_now : 0;
+}
+
+void timers_run( void ) {
+	unsigned char *t;
+
+	if( timers_paused ) return;
+
+	timer_now++;
+	t = &wheel[timer_now & (WHEEL_SLOTS-1)];
+	while( *t != TIMER_NONE ) {
+		unsigned char id = *t;
+		if( timer_due[id] == timer_now ) {
+			*t = timer_chain[id];
+			timers_running &= ~(1<<id);
+			timers_fired |= (1<<id);
+		}
+		else {
+			t = &timer_chain[id];
+		}
+	}
+}
+
 void text_write_number( char x, char y, unsigned long num, align_t align, unsigned char space_tile ) {
 	char digits[15];
 	int pos = 0;
@@ -202,44 +441,330 @@ void text_write_number( char x, char y, unsigned long num, align_t align, unsign
 	}
 }
 
-void text_write( char x, char y, const char *text ) {
-	char *p = (char*)text;
+void text_char( char x, char y, char c ) {
 	unsigned char t = 0;
 	
-	while( *p ) {
-		if ( *p >= 'A' && *p <= 'Z' ) {
-			t = *p - 'A' + 11;
+	if ( c >= 'A' && c <= 'Z' ) {
+		t = c - 'A' + 11;
+	}
+	else if( c >= '0' && c <= '9' ) {
+		t = c - '0' + 1;
+	}
+	else {
+		switch( c ) {
+			case '.': t=37; break;
+			case '!': t=38; break;
+			case '/': t=39; break;
+			case 'c': t=40; break;
+			default: t = 0; // blank
 		}
-		else if( *p >= '0' && *p <= '9' ) {
-			t = *p - '0' + 1;
+	}
+	if( t ) {
+		SetTile(x, y, t + FIRST_TEXT_TILE );
+	}
+}
+
+void text_write( char x, char y, const char *text ) {
+	while( *text ) {
+		text_char( x++, y, *text++ );
+	}
+}
+
+void text_write_P( char x, char y, const char *text ) {
+	// As text_write(), for PSTR() strings, which would otherwise each take
+	// their length in SRAM.
+	char c;
+
+	while( (c = pgm_read_byte( text++ )) ) {
+		text_char( x++, y, c );
+	}
+}
+
+// Logical sprites from most to least important. Projectiles come first as the
+// game is unplayable without them; the right half of a projectile is only
+// shown along with its left half. The trailing low priority entries are
+// rotated each frame, so if they don't all fit they take turns (flicker)
+// rather than one of them vanishing altogether.
+// Particles always come last, being purely decorative.
+#define LOW_PRIORITY_OBJECTS 4
+const unsigned char object_order[SPRITE_PARTICLE] PROGMEM = {
+	SPRITE_PROJ_L,   SPRITE_PROJ_R,
+	SPRITE_PROJ_L+1, SPRITE_PROJ_R+1,
+	SPRITE_ARROW,    SPRITE_ARROW+1,
+	SPRITE_RING,     SPRITE_RIVET,
+	SPRITE_RING+1,   SPRITE_RIVET+1 };
+
+#if PROFILE
+void latency_arm( player_t *pl ) {
+	if( !quiet && (pad_local & (1 << pl->index)) ) {
+		latency_seen[pl->index] = pad_latched;
+		latency_pending[pl->index] = true;
+	}
+}
+
+void latency_commit( void ) {
+	// Whatever is handed to the kernel now is shown in the next field.
+	unsigned char p, l;
+
+	for( p=0 ; p < PLAYERS ; p++ ) {
+		if( latency_pending[p] ) {
+			l = vsync_count - latency_seen[p];
+			latency_hist[ l < LATENCY_BUCKETS-1 ? l : LATENCY_BUCKETS-1 ]++;
+			latency_pending[p] = false;
+		}
+	}
+}
+#endif
+
+bool ram_tiles_claim( unsigned int *map, unsigned char x, unsigned char y, unsigned char w ) {
+	// Add the tiles covered by a w pixel wide sprite at x,y to the map of
+	// screen tiles claimed so far, unless that would exceed the number of
+	// RAM tiles available.
+	unsigned int claim[6];
+	unsigned char n = 0, i, j, tx, ty;
+
+	for( ty = y/TILE_HEIGHT ; ty <= (y+TILE_HEIGHT-1)/TILE_HEIGHT && ty < SCREEN_TILES_V ; ty++ ) {
+		for( tx = x/TILE_WIDTH ; tx <= (x+w-1)/TILE_WIDTH && tx < SCREEN_TILES_H ; tx++ ) {
+			unsigned int t = (ty*SCREEN_TILES_H) + tx;
+			for( j=0 ; j < ram_tiles_used ; j++ ) {
+				if( map[j] == t ) break;
+			}
+			if( j == ram_tiles_used ) {
+				claim[n++] = t;
+			}
+		}
+	}
+
+	if( ram_tiles_used + n > RAM_TILES_COUNT ) {
+		return false;
+	}
+	for( i=0 ; i < n ; i++ ) {
+		map[ram_tiles_used++] = claim[i];
+	}
+	return true;
+}
+
+void sprite_commit( void ) {
+	unsigned char i, slot;
+	unsigned int shown = 0;
+	// Screen tiles covered by sprites so far, each costing one RAM tile.
+	unsigned int map[RAM_TILES_COUNT];
+
+	ram_tiles_used = 0;
+	sprite_mux++;
+
+	for( i=0 ; i < OBJECTS ; i++ ) {
+		if( i >= SPRITE_PARTICLE ) {
+			slot = i;
+		}
+		else if( i < SPRITE_PARTICLE-LOW_PRIORITY_OBJECTS ) {
+			slot = pgm_read_byte( object_order + i );
 		}
 		else {
-			switch( *p ) {
-				case '.': t=37; break;
-				case '!': t=38; break;
-				case '/': t=39; break;
-				case 'c': t=40; break;
-				default: t = 0; // blank
+			slot = pgm_read_byte( object_order + SPRITE_PARTICLE-LOW_PRIORITY_OBJECTS
+				+ ((i + sprite_mux) % LOW_PRIORITY_OBJECTS) );
+		}
+
+		if( object_x[slot] >= SPRITE_HIDDEN_X ) {
+			sprites[slot].x = SPRITE_HIDDEN_X;
+			continue;
+		}
+
+		if( slot == SPRITE_PROJ_R || slot == SPRITE_PROJ_R+1 ) {
+			// Tiles were claimed along with the left half.
+			if( shown & (1<<(slot-(SPRITE_PROJ_R-SPRITE_PROJ_L))) ) {
+				shown |= (1<<slot);
+			}
+		}
+		else if( ram_tiles_claim( map, object_x[slot], sprites[slot].y,
+				(slot == SPRITE_PROJ_L || slot == SPRITE_PROJ_L+1) ? TILE_WIDTH*2 : TILE_WIDTH ) ) {
+			shown |= (1<<slot);
+		}
+
+		if( shown & (1<<slot) ) {
+			sprites[slot].x = object_x[slot];
+		}
+		else {
+			sprites[slot].x = SPRITE_HIDDEN_X;
+			sprites_dropped++;
+		}
+	}
+
+	if( ram_tiles_used > ram_tiles_peak ) {
+		ram_tiles_peak = ram_tiles_used;
+	}
+#if PROFILE
+	latency_commit();
+#endif
+}
+
+void sprite_update( unsigned char slot ) {
+	// Hand a moved sprite to the kernel straight away, if it was shown last
+	// time round. The budget is checked again at the next sprite_commit().
+	if( sprites[slot].x != SPRITE_HIDDEN_X ) {
+		sprites[slot].x = object_x[slot];
+#if PROFILE
+		latency_commit();
+#endif
+	}
+}
+
+void sprite_hide_all( void ) {
+	unsigned char i;
+
+	for( i=0 ; i < MAX_SPRITES ; i++ ) {
+		sprites[i].x = SPRITE_HIDDEN_X;
+	}
+	for( i=0 ; i < OBJECTS ; i++ ) {
+		object_x[i] = SPRITE_HIDDEN_X;
+	}
+}
+
+void particles_clear( void ) {
+	unsigned char i;
+
+	for( i=0 ; i < PARTICLES ; i++ ) {
+		part_life[i] = 0;
+	}
+	particles_live = 0;
+}
+
+void particle_spawn( unsigned char x, unsigned char y, signed char dx, signed char dy, unsigned char tile ) {
+	unsigned char i;
+
+	for( i=0 ; i < PARTICLES ; i++ ) {
+		if( part_life[i] == 0 ) {
+			part_x[i] = x;
+			part_y[i] = y;
+			part_frac[i] = 0;
+			part_dx[i] = dx;
+			part_dy[i] = dy;
+			part_tile[i] = tile;
+			part_life[i] = PARTICLE_LIFE;
+			particles_live++;
+			return;
+		}
+	}
+	particles_dropped++;
+}
+
+void particles_update( void ) {
+	// Only live particles count against the cap; the scan stops after one
+	// pass over the pool either way.
+	unsigned char n, moved = 0, i = part_update_next;
+	int x, y;
+
+	for( n=0 ; n < PARTICLES && moved < PARTICLE_UPDATE_CAP ; n++ ) {
+		if( part_life[i] ) {
+			moved++;
+			x = (part_x[i] << PARTICLE_SHIFT) + (part_frac[i] >> 4) + part_dx[i];
+			y = (part_y[i] << PARTICLE_SHIFT) + (part_frac[i] & 0x0f) + part_dy[i];
+			if( part_dy[i] < 127-PARTICLE_GRAVITY ) {
+				part_dy[i] += PARTICLE_GRAVITY;
+			}
+			if( --part_life[i] == 0
+				|| x < 0 || x >= (SPRITE_HIDDEN_X << PARTICLE_SHIFT)
+				|| y < 0 || y >= ((SCREEN_TILES_V*TILE_HEIGHT) << PARTICLE_SHIFT) ) {
+				part_life[i] = 0;
+				particles_live--;
+			}
+			else {
+				part_x[i] = x >> PARTICLE_SHIFT;
+				part_y[i] = y >> PARTICLE_SHIFT;
+				part_frac[i] = ((x & 0x0f) << 4) | (y & 0x0f);
 			}
 		}
-		if( t ) {
-			SetTile(x, y, t + FIRST_TEXT_TILE );
+		if( ++i == PARTICLES ) i = 0;
+	}
+	part_update_next = i;
+}
+
+void particles_draw( void ) {
+	// Hand out the particle sprites round-robin when there are more live
+	// particles than sprites.
+	unsigned char n, s = 0, i = part_draw_next;
+
+	for( n=0 ; n < PARTICLES && s < PARTICLE_SPRITES ; n++ ) {
+		if( part_life[i] ) {
+			object_x[SPRITE_PARTICLE+s] = part_x[i];
+			sprites[SPRITE_PARTICLE+s].y = part_y[i];
+			sprites[SPRITE_PARTICLE+s].tileIndex = part_tile[i];
+			s++;
 		}
-		x++;
-		p++;
+		if( ++i == PARTICLES ) i = 0;
+	}
+	part_draw_next = i;
+
+	while( s < PARTICLE_SPRITES ) {
+		object_x[SPRITE_PARTICLE+s] = SPRITE_HIDDEN_X;
+		s++;
 	}
 }
 
-void draw_field( unsigned char player ) {
-	unsigned char x,y,xp,yp,b=0;
+#if PROFILE
+#include <util/delay_basic.h>
+
+// Stack high-water mark. Everything between the end of the globals and the
+// stack is painted at boot; the stack only grows down into the paint, so the
+// first overwritten byte above _end marks the deepest it has been.
+#define STACK_PAINT	0xc5
+#define STACK_MARGIN 16
+// What "make stack" makes of the deepest call path, 0 until it's been run.
+#ifndef STACK_STATIC
+#define STACK_STATIC 0
+#endif
+extern unsigned char _end;
+
+void stack_paint( void ) {
+	unsigned char *p = &_end;
 
-	for( y=0 ; y+drop < FIELD_TILES_V ; y++ ) {
+	while( p < (unsigned char*)SP - STACK_MARGIN ) *p++ = STACK_PAINT;
+}
+
+unsigned int stack_free( void ) {
+	// Bytes never touched by the stack since boot.
+	const unsigned char *p = &_end;
+
+	while( *p == STACK_PAINT && p < (unsigned char*)RAMEND ) p++;
+	return p - &_end;
+}
+
+void prof_number( unsigned char x, unsigned char y, unsigned int num, unsigned char width ) {
+	// Fixed width, so that shrinking numbers don't leave digits behind.
+	while( width-- ) {
+		SetTile( x--, y, BG_SPACE_TILE + (num%10) );
+		num /= 10;
+	}
+}
+
+void prof_draw( void ) {
+	unsigned char i;
+
+	prof_number( 1, PROF_Y, ram_tiles_used, 2 );
+	prof_number( 4, PROF_Y, ram_tiles_peak, 2 );
+	prof_number( 9, PROF_Y, sprites_dropped, 5 );
+	prof_number( 12, PROF_Y, particles_live, 2 );
+	prof_number( 17, PROF_Y, particles_dropped, 4 );
+	prof_number( 22, PROF_Y, stack_free(), 4 );
+	prof_number( 27, PROF_Y, field_deferrals, 4 );
+	prof_number( 26, PROF_Y+1, fx_dropped_total, 3 );
+	prof_number( 29, PROF_Y+1, fx_stolen_total, 3 );
+	for( i=0 ; i < LATENCY_BUCKETS ; i++ ) {
+		prof_number( 3+(i*4), LATENCY_Y, latency_hist[i], 3 );
+	}
+}
+#endif
+
+void draw_field_row( player_t *pl, unsigned char y ) {
+	unsigned char x,xp,yp,b=FIRST_IN_ROW(y);
+
+	if( y+drop < FIELD_TILES_V ) {
 		for( x=0 ; x < FIELD_TILES_H ; x++ ) {
 			if( players == 1 ) {
 				xp = ((SCREEN_TILES_H-FIELD_TILES_H)/2) + x;
 			}
 			else {
-				xp = FIELD_OFFSET_X + (P2_TILE_OFFSET*player) + x;
+				xp = FIELD_OFFSET_X + (P2_TILE_OFFSET*pl->index) + x;
 			}
 			yp = FIELD_OFFSET_Y + y + drop;
 
@@ -250,25 +775,25 @@ void draw_field( unsigned char player ) {
 				switch( x%3 ) {
 					case 0:
 						// Left-most tile
-						if( bubbles[player][b] != C_BLANK ) {
-							SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(bubbles[player][b]-1)) );
+						if( pl->bubbles[b] != C_BLANK ) {
+							SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(pl->bubbles[b]-1)) );
 						}
 						break;
 					case 1:
 						// Split tile
-						if( bubbles[player][b] == C_BLANK ) {
-							SetTile( xp, yp, BUBBLE_FIRST_TILE + bubbles[player][b+1] + 1 );
+						if( pl->bubbles[b] == C_BLANK ) {
+							SetTile( xp, yp, BUBBLE_FIRST_TILE + pl->bubbles[b+1] + 1 );
 						}
 						else {
-							SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(bubbles[player][b]-1))
-								+ bubbles[player][b+1] + BUBBLE_EVEN_R_SPLIT );
+							SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(pl->bubbles[b]-1))
+								+ pl->bubbles[b+1] + BUBBLE_EVEN_R_SPLIT );
 						}
 						b++;
 						break;
 					case 2:
 						// Right-most tile
-						if( bubbles[player][b] != C_BLANK ) {
-							SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(bubbles[player][b]-1)) + BUBBLE_EVEN_R_WHOLE );
+						if( pl->bubbles[b] != C_BLANK ) {
+							SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(pl->bubbles[b]-1)) + BUBBLE_EVEN_R_WHOLE );
 						}
 						b++;
 						break;
@@ -278,34 +803,34 @@ void draw_field( unsigned char player ) {
 				// Odd row
 				switch( x%3 ) {
 					case 0:
-						if( (x == 0 || bubbles[player][b-1] == C_BLANK) && bubbles[player][b] != C_BLANK && bubbles[player][b] != C_POP ) {
+						if( (x == 0 || pl->bubbles[b-1] == C_BLANK) && pl->bubbles[b] != C_BLANK && pl->bubbles[b] != C_POP ) {
 							SetTile( xp, yp, BUBBLE_SLIVER_L );
 						}
-						else if( bubbles[player][b] != C_BLANK && bubbles[player][b] != C_POP ) {
-							SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(bubbles[player][b-1]-1)) + BUBBLE_ODD_R );
+						else if( pl->bubbles[b] != C_BLANK && pl->bubbles[b] != C_POP ) {
+							SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(pl->bubbles[b-1]-1)) + BUBBLE_ODD_R );
 
 						}
-						else if( bubbles[player][b-1] != C_BLANK && bubbles[player][b-1] != C_POP && x != 0 ) {
-							SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(bubbles[player][b-1]-1)) + BUBBLE_ODD_R_BLANK );
+						else if( pl->bubbles[b-1] != C_BLANK && pl->bubbles[b-1] != C_POP && x != 0 ) {
+							SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(pl->bubbles[b-1]-1)) + BUBBLE_ODD_R_BLANK );
 						}
 						break;
 					case 1:
-						if( bubbles[player][b] != C_BLANK ) {
-							SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(bubbles[player][b]-1)) + BUBBLE_ODD_MIDDLE );
+						if( pl->bubbles[b] != C_BLANK ) {
+							SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(pl->bubbles[b]-1)) + BUBBLE_ODD_MIDDLE );
 						}
 						b++;
 						break;
 					case 2:
-						if( ( x == FIELD_TILES_H-1 || bubbles[player][b] == C_BLANK) && bubbles[player][b-1] != C_BLANK && bubbles[player][b-1] != C_POP ) {
+						if( ( x == FIELD_TILES_H-1 || pl->bubbles[b] == C_BLANK) && pl->bubbles[b-1] != C_BLANK && pl->bubbles[b-1] != C_POP ) {
 							SetTile( xp, yp, BUBBLE_SLIVER_R );
 						}
 						else if( x != FIELD_TILES_H-1 ) {
-							if( bubbles[player][b] != C_BLANK ) {
-								if( bubbles[player][b-1] == C_BLANK || bubbles[player][b-1] == C_POP ) {
-									SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(bubbles[player][b]-1)) + BUBBLE_ODD_L_BLANK );
+							if( pl->bubbles[b] != C_BLANK ) {
+								if( pl->bubbles[b-1] == C_BLANK || pl->bubbles[b-1] == C_POP ) {
+									SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(pl->bubbles[b]-1)) + BUBBLE_ODD_L_BLANK );
 								}
 								else {
-									SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(bubbles[player][b]-1)) + BUBBLE_ODD_L );
+									SetTile( xp, yp, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(pl->bubbles[b]-1)) + BUBBLE_ODD_L );
 								}
 							}
 						}
@@ -320,46 +845,145 @@ void draw_field( unsigned char player ) {
 	}
 }
 
-void new_bubble( unsigned char player ) {
-	if( player < players ) {
-		current[player] = next[player];
-		next[player] = ((random()+frame)%(C_COUNT-2)) + 1;
+void draw_field( player_t *pl ) {
+	// Queue the whole field for redrawing by field_flush().
+	if( quiet ) return;
+	field_dirty[pl->index] = (1 << FIELD_TILES_V) - 1;
+}
 
-		proj[player].x = ((FIELD_TILES_H*TILE_WIDTH)/2) - (BUBBLE_WIDTH/2);
-		proj[player].y = ((FIELD_TILES_V+1)*TILE_HEIGHT) - (BUBBLE_WIDTH/2);
-	
-		proj[player].x <<= TRAJ_SHIFT;
-		proj[player].y <<= TRAJ_SHIFT;
+void field_flush( void ) {
+	// Draw queued field rows, top to bottom and both players' fields in
+	// step, until this field's share of rows is used up or the vsync has
+	// already gone by. Anything left over waits for the next frame, so a
+	// pile-up of redraws costs a frame or two of stale rows rather than a
+	// dropped frame. Sprites are committed separately and keep up anyway.
+	unsigned char y, p;
+
+	for( y=0 ; y < FIELD_TILES_V ; y++ ) {
+		for( p=0 ; p < players ; p++ ) {
+			if( field_dirty[p] & (1 << y) ) {
+				if( !field_rows_left || GetVsyncFlag() ) {
+					field_deferrals++;
+					return;
+				}
+				draw_field_row( &player_ctx[p], y );
+				field_dirty[p] &= ~(1 << y);
+				field_rows_left--;
+			}
+		}
+	}
+}
+void field_finish( void ) {
+	// Draw whatever is still queued, however many frames it takes.
+	while( field_dirty[0] || (players == 2 && field_dirty[1]) ) {
+		WaitVsync(1);
+		field_rows_left = FIELD_ROW_BUDGET;
+		field_flush();
+	}
+}
 
-		sprites[SPRITE_PROJ_L+player].tileIndex = TILE_BUBBLE_L( current[(int)player] );
-		sprites[SPRITE_PROJ_R+player].tileIndex = TILE_BUBBLE_R( current[(int)player] );
+long game_random( void ) {
+	return random_r( &rng_state );
+}
+
+void draw_queued( unsigned char x, unsigned char y, unsigned char colour ) {
+	SetTile( x, y, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(colour-1)) + BUBBLE_ODD_L_BLANK );
+	SetTile( x+1, y, BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(colour-1)) + BUBBLE_ODD_R_BLANK );
+}
+
+void draw_next( player_t *pl, unsigned char dirty ) {
+	// Only queue slots with a bit set in "dirty" are redrawn.
+	unsigned char i, x, side, y = FIELD_OFFSET_Y + FIELD_TILES_V + 1;
+
+	if( pl->index < players && !quiet ) {
+		sprites[SPRITE_PROJ_L+pl->index].tileIndex = TILE_BUBBLE_L( pl->current );
+		sprites[SPRITE_PROJ_R+pl->index].tileIndex = TILE_BUBBLE_R( pl->current );
 
 		if( players == 1 ) {
-			SetTile( ((SCREEN_TILES_H-FIELD_TILES_H)/2) + FIELD_TILES_H - 2, FIELD_OFFSET_Y + FIELD_TILES_V + 1,
-				BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(next[player]-1)) + BUBBLE_ODD_L_BLANK);
-			SetTile( ((SCREEN_TILES_H-FIELD_TILES_H)/2) + FIELD_TILES_H - 1, FIELD_OFFSET_Y + FIELD_TILES_V + 1,
-				BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(next[player]-1)) + BUBBLE_ODD_R_BLANK);
+			x = ((SCREEN_TILES_H-FIELD_TILES_H)/2) + FIELD_TILES_H - 2;
+			side = x + 3;
 		}
 		else {
-			SetTile( FIELD_OFFSET_X + (P2_TILE_OFFSET*player) + FIELD_TILES_H - 2, FIELD_OFFSET_Y + FIELD_TILES_V + 1,
-				BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(next[player]-1)) + BUBBLE_ODD_L_BLANK);
-			SetTile( FIELD_OFFSET_X + (P2_TILE_OFFSET*player) + FIELD_TILES_H - 1, FIELD_OFFSET_Y + FIELD_TILES_V + 1,
-				BUBBLE_FIRST_COLOUR_TILE + (BUBBLES_PER_COLOUR*(next[player]-1)) + BUBBLE_ODD_R_BLANK);			
+			x = FIELD_OFFSET_X + (P2_TILE_OFFSET*pl->index) + FIELD_TILES_H - 2;
+			side = pl->index ? SCREEN_TILES_H - 2 : 0;
+		}
+
+		if( dirty & 1 ) draw_queued( x, y, pl->queue[0] );
+		for( i=1 ; i < NEXT_QUEUE ; i++ ) {
+			if( dirty & (1 << i) ) draw_queued( side, y - (2*i), pl->queue[i] );
+		}
+	}
+}
+
+void colour_count_scan( player_t *pl ) {
+	// Only needed when a whole field appears at once; play keeps the
+	// counts up to date as bubbles land, pop and fall.
+	unsigned char i;
+
+	memset( pl->colour_count, 0, sizeof(pl->colour_count) );
+	for( i=0 ; i < NUM_BUBBLES ; i++ ) {
+		if( pl->bubbles[i] != C_POP ) pl->colour_count[pl->bubbles[i]]++;
+	}
+}
+
+unsigned char bag_deal( player_t *pl ) {
+	// Every colour still on the field comes out once before any comes out
+	// twice; colours cleared from the field since the bag was filled are
+	// skipped while there's anything else left in it.
+	unsigned char c, n, present = 0;
+
+	for( c=C_BLANK+1 ; c < C_POP ; c++ ) {
+		if( pl->colour_count[c] ) present |= 1 << (c-1);
+	}
+	if( !present ) present = (1 << (C_POP-1)) - 1;
+	// Refill once nothing left in the bag is on the field, otherwise drop
+	// the cleared colours.
+	if( !(pl->bag & present) ) pl->bag = present;
+	pl->bag &= present;
+
+	for( n=0, c=pl->bag ; c ; c >>= 1 ) n += c & 1;
+	n = (game_random()+frame) % n;
+	for( c=C_BLANK+1 ; ; c++ ) {
+		if( (pl->bag & (1 << (c-1))) && !n-- ) break;
+	}
+	pl->bag &= ~(1 << (c-1));
+	return c;
+}
+
+void new_bubble( player_t *pl ) {
+	unsigned char i, dirty = 0;
+
+	if( pl->index < players ) {
+		pl->current = pl->queue[0];
+		for( i=0 ; i < NEXT_QUEUE-1 ; i++ ) {
+			if( pl->queue[i] != pl->queue[i+1] ) dirty |= 1 << i;
+			pl->queue[i] = pl->queue[i+1];
 		}
+		pl->queue[NEXT_QUEUE-1] = bag_deal( pl );
+		dirty |= 1 << (NEXT_QUEUE-1);
+
+		pl->proj.x = ((FIELD_TILES_H*TILE_WIDTH)/2) - (BUBBLE_WIDTH/2);
+		pl->proj.y = ((FIELD_TILES_V+1)*TILE_HEIGHT) - (BUBBLE_WIDTH/2);
+	
+		pl->proj.x <<= TRAJ_SHIFT;
+		pl->proj.y <<= TRAJ_SHIFT;
+
+		draw_next( pl, dirty );
 	}
 }
 
-bool drop_bubbles( unsigned char player ) {
+bool drop_bubbles( player_t *pl ) {
 	int i;
 	bool bottomed_out = false;
 	unsigned char last_row = BUBBLE_ROWS-1-drop;
 	
 	// Check if lowest row had bubbles.
 	for( i = FIRST_IN_ROW(last_row) ; i < FIRST_IN_ROW(last_row)+ROW_WIDTH(last_row) ; i++ ) {
-		if( bubbles[player][i] != C_BLANK ) {
+		if( pl->bubbles[i] != C_BLANK ) {
 			bottomed_out = true;
+			if( pl->bubbles[i] != C_POP ) pl->colour_count[pl->bubbles[i]]--;
 		}
-		bubbles[player][i] = C_BLANK;
+		pl->bubbles[i] = C_BLANK;
 	}
 
 	drop++;
@@ -371,146 +995,396 @@ bool drop_bubbles( unsigned char player ) {
 	return bottomed_out;
 }
 
+// Every two seconds of wobbling the bar shakes faster, changing state at
+// these intervals.
+const unsigned char wobble_half_step[WOBBLE_SECONDS] PROGMEM = {
+	FPS/2, FPS/3, FPS/4, FPS/5, FPS/6 };
+
+void wobble_start( void ) {
+	// The first shake is due when the delay runs out, but the bar is already
+	// still at that point, so start on the half step after it.
+	wobble_second = 0;
+	wobble_count = 1;
+	timer_set( TIMER_WOBBLE, WOBBLE_DELAY + (FPS/2) );
+}
+
 bool do_wobble( void ) {
-	int second = wobble_timer/(FPS*2);
+	// Called each time TIMER_WOBBLE fires.
 	bool bottomed_out = false;
 	
-	if( second < WOBBLE_SECONDS ) {
-		int step = (FPS*2)/(second+2);
-		if( wobble_timer % step == 0 ) {
+	if( wobble_second < WOBBLE_SECONDS ) {
+		unsigned char half_step = pgm_read_byte( wobble_half_step + wobble_second );
+		if( wobble_count & 1 ) {
+			DrawMap2( (SCREEN_TILES_H-FIELD_TILES_H)/2, FIELD_OFFSET_Y+drop-1, map_drop_bar_normal );
+		}
+		else {
 			DrawMap2( (SCREEN_TILES_H-FIELD_TILES_H)/2, FIELD_OFFSET_Y+drop-1, map_drop_bar_shake );
 		}
-		else if( wobble_timer % step == step/2 ) {
-			DrawMap2( (SCREEN_TILES_H-FIELD_TILES_H)/2, FIELD_OFFSET_Y+drop-1, map_drop_bar_normal );
+		if( ++wobble_count == 2*(wobble_second+2) ) {
+			wobble_count = 0;
+			wobble_second++;
 		}
+		timer_set( TIMER_WOBBLE, half_step );
 	}
 	else {
-		bottomed_out = drop_bubbles(0);
+		bottomed_out = drop_bubbles( &player_ctx[0] );
 		
-		draw_field(0);
+		draw_field( &player_ctx[0] );
 		DrawMap2( (SCREEN_TILES_H-FIELD_TILES_H)/2, FIELD_OFFSET_Y+drop-2, map_drop_bar_clear );
 		DrawMap2( (SCREEN_TILES_H-FIELD_TILES_H)/2, FIELD_OFFSET_Y+drop-1, map_drop_bar_normal );
 		
-		wobble_timer = -WOBBLE_DELAY;
+		wobble_start();
 	}
 	return bottomed_out;
 }
 
-bool proc_controls( unsigned char player ) {
+// Music player for songs converted by tools/songconv, which folds the delta
+// times into the events and shares repeated bars, so a tick is mostly one
+// or two flash reads per note instead of the kernel's varlen and running
+// status decoding. Runs from the vsync callback, one tick per field.
+#define SONG_WAIT		0x80
+#define SONG_PATCH		0xc0
+#define SONG_CALL		0xd0
+#define SONG_LOOP_START	0xe0
+#define SONG_LOOP_END	0xe1
+#define SONG_END		0xff
+#define SONG_CHANNELS	4
+volatile bool song_playing = false;
+const char *song_start;
+const char *song_pos;
+const char *song_loop;
+// Where to carry on after a shared bar, and where that bar ends.
+const char *song_return;
+const char *song_call_end;
+unsigned char song_wait;
+unsigned char song_patch[SONG_CHANNELS];
+unsigned char song_volume[SONG_CHANNELS];
+unsigned char song_note[SONG_CHANNELS];
+
+// Sound effects, queued by sound_fx() during a frame and started together
+// by fx_commit(). Repeats of an effect within the frame are merged into one
+// trigger, and each is given a channel by priority: a channel already
+// playing the same effect, then one only the music is using, then one with
+// a less important effect. Anything left over is dropped. Effects are
+// played with TriggerNote() so that the channel choice is ours rather than
+// TriggerFx()'s; song_tick() leaves a channel alone while an effect has it,
+// and sound_tick() gives it back to the music when the effect ends.
+#define FX_FIRST	PATCH_TICK
+#define FX_COUNT	(PATCH_LOSE-PATCH_TICK+1)
+// Note the effects are started on, as with TriggerFx().
+#define FX_NOTE		80
+#define FX_TONE		0x07
+#define FX_NOISE	0x08
+#define FX_PRIORITIES	4
+typedef struct {
+	// Higher wins a channel, 0 to FX_PRIORITIES-1.
+	unsigned char priority;
+	// Channels the effect can be played on.
+	unsigned char channels;
+	// Ticks until the patch's note cut.
+	unsigned char length;
+} fx_t;
+const fx_t fx_info[FX_COUNT] PROGMEM = {
+	{ 0, FX_NOISE, 3 },		// PATCH_TICK
+	{ 2, FX_TONE, 34 },		// PATCH_SHOOT
+	{ 1, FX_NOISE, 16 },	// PATCH_POP
+	{ 3, FX_TONE, 188 },	// PATCH_WIN1
+	{ 3, FX_TONE, 188 },	// PATCH_WIN2
+	{ 3, FX_TONE, 172 } };	// PATCH_LOSE
+// Requested this frame, 0 for none.
+unsigned char fx_volume[FX_COUNT];
+// Effect on each channel and the ticks it has left, counted down by
+// sound_tick().
+unsigned char fx_patch[SONG_CHANNELS];
+volatile unsigned char fx_left[SONG_CHANNELS];
+// What happened at the last fx_commit(): effects started, effects that
+// found no channel, and started effects that cut off music or another
+// effect.
+unsigned char fx_triggered;
+unsigned char fx_dropped;
+unsigned char fx_stolen;
+
+void song_tick( void ) {
+	unsigned char c, channel;
+	const char *bar;
+
+	if( !song_playing ) return;
+	if( song_wait ) {
+		song_wait--;
+		return;
+	}
+
+	while( 1 ) {
+		if( song_pos == song_call_end ) {
+			song_pos = song_return;
+			song_call_end = NULL;
+		}
+		c = pgm_read_byte( song_pos++ );
+		if( !(c & 0x80) ) {
+			channel = (c >> 5) & 3;
+			song_note[channel] = pgm_read_byte( song_pos++ );
+			if( c & 0x10 ) {
+				song_volume[channel] = pgm_read_byte( song_pos++ ) << 1;
+			}
+			if( !fx_left[channel] ) {
+				TriggerNote( channel, song_patch[channel], song_note[channel], song_volume[channel] );
+			}
+			if( c & 0x0f ) {
+				song_wait = (c & 0x0f) - 1;
+				return;
+			}
+		}
+		else if( c < SONG_PATCH ) {
+			song_wait = (c & ~SONG_WAIT) - 1;
+			return;
+		}
+		else if( c < SONG_CALL ) {
+			song_patch[c & (SONG_CHANNELS-1)] = pgm_read_byte( song_pos++ );
+		}
+		else if( c == SONG_CALL ) {
+			bar = song_start + pgm_read_word( song_pos );
+			song_call_end = bar + pgm_read_byte( song_pos+2 );
+			song_return = song_pos + 3;
+			song_pos = bar;
+		}
+		else if( c == SONG_LOOP_START ) {
+			song_loop = song_pos;
+		}
+		else if( c == SONG_LOOP_END ) {
+			song_pos = song_loop;
+		}
+		else {
+			song_playing = false;
+			return;
+		}
+	}
+}
+
+void song_play( const char *song ) {
+	song_playing = false;
+	song_start = song_pos = song_loop = song;
+	song_call_end = NULL;
+	song_wait = 0;
+	memset( song_volume, 0, sizeof(song_volume) );
+	song_playing = true;
+}
+
+void song_stop( void ) {
+	// Release whatever each channel was last given, as StopSong() would.
+	unsigned char i;
+
+	song_playing = false;
+	for( i=0 ; i < SONG_CHANNELS ; i++ ) {
+		TriggerNote( i, song_patch[i], song_note[i], 0 );
+	}
+}
+
+void sound_tick( void ) {
+	// Runs from the vsync callback.
+	unsigned char i;
+
+#if PROFILE
+	vsync_count++;
+#endif
+	for( i=0 ; i < SONG_CHANNELS ; i++ ) {
+		// Hand the channel back to the music, picking up whatever note it
+		// would have been holding had the effect not had it.
+		if( fx_left[i] && !--fx_left[i] && song_playing ) {
+			TriggerNote( i, song_patch[i], song_note[i], song_volume[i] );
+		}
+	}
+	song_tick();
+}
+
+void sound_fx( unsigned char patch, unsigned char volume ) {
+	// Queue an effect for fx_commit().
+	if( quiet ) return;
+	if( volume > fx_volume[patch-FX_FIRST] ) {
+		fx_volume[patch-FX_FIRST] = volume;
+	}
+}
+
+unsigned char fx_priority( unsigned char channel ) {
+	return pgm_read_byte( &fx_info[fx_patch[channel]-FX_FIRST].priority );
+}
+
+void fx_commit( void ) {
+	unsigned char n, priority, c, best;
+	fx_t info;
+
+	fx_triggered = fx_dropped = fx_stolen = 0;
+
+	// Most important first, so nothing is cut off by a lesser effect queued
+	// in the same frame.
+	for( priority=FX_PRIORITIES ; priority-- ; ) {
+		for( n=0 ; n < FX_COUNT ; n++ ) {
+			if( !fx_volume[n] ) continue;
+			memcpy_P( &info, fx_info + n, sizeof(info) );
+			if( info.priority != priority ) continue;
+
+			// Highest channel first, so the lead on channel 0 is the last
+			// of the music to go.
+			best = SONG_CHANNELS;
+			for( c=SONG_CHANNELS ; c-- ; ) {
+				if( !(info.channels & (1 << c)) ) continue;
+				if( fx_left[c] && fx_patch[c] == n+FX_FIRST ) {
+					best = c;
+					break;
+				}
+				if( !fx_left[c] ) {
+					if( best == SONG_CHANNELS || fx_left[best] ) best = c;
+				}
+				else if( fx_priority( c ) < info.priority ) {
+					if( best == SONG_CHANNELS || (fx_left[best] && fx_priority( c ) < fx_priority( best )) ) best = c;
+				}
+			}
+
+			if( best == SONG_CHANNELS ) {
+				fx_dropped++;
+			}
+			else {
+				if( (fx_left[best] && fx_patch[best] != n+FX_FIRST) || (!fx_left[best] && song_playing) ) {
+					fx_stolen++;
+				}
+				fx_patch[best] = n+FX_FIRST;
+				fx_left[best] = info.length;
+				TriggerNote( best, n+FX_FIRST, FX_NOTE, fx_volume[n] );
+				fx_triggered++;
+			}
+			fx_volume[n] = 0;
+		}
+	}
+#if PROFILE
+	fx_dropped_total += fx_dropped;
+	fx_stolen_total += fx_stolen;
+#endif
+}
+
+bool proc_controls( player_t *pl ) {
 	bool changed = false;
-	int buttons = ReadJoypad(player);
-	
-	if( block_left[player]  ) block_left[player]--;
-	if( block_right[player] ) block_right[player]--;
+	int buttons = pl->pad;
 	
 	if( buttons & BTN_LEFT ) {
-		if( !block_left[player] ) {
+		if( !timer_running( TIMER_LEFT+pl->index ) ) {
 			// Rotate left
-			TriggerFx( PATCH_TICK, 0x80, true );
-			angle[(int)player]--;
-			if( angle[(int)player] < -(ANGLES-1) ) {
-				angle[(int)player] = -(ANGLES-1);
+			sound_fx( PATCH_TICK, 0x80 );
+			if( pl->angle > -(ANGLES-1) ) {
+				pl->angle--;
+				changed = true;
 			}
-			changed = true;
-			block_left[player] = 5;
-			block_right[player] = 0;
+			timer_set( TIMER_LEFT+pl->index, REPEAT_DELAY );
+			timer_cancel( TIMER_RIGHT+pl->index );
 		}
 	}
 	else {
-		block_left[player] = 0;
+		timer_cancel( TIMER_LEFT+pl->index );
 	}
 	
 	if( buttons & BTN_RIGHT ) {
-		if( !block_right[player] ) {
+		if( !timer_running( TIMER_RIGHT+pl->index ) ) {
 			// Rotate right
-			TriggerFx( PATCH_TICK, 0x80, true );
-			angle[(int)player]++;
-			if( angle[(int)player] > ANGLES-1 ) {
-				angle[(int)player] = ANGLES-1;
+			sound_fx( PATCH_TICK, 0x80 );
+			if( pl->angle < ANGLES-1 ) {
+				pl->angle++;
+				changed = true;
 			}
-			changed = true;
-			block_right[player] = 5;
-			block_left[player] = 0;
+			timer_set( TIMER_RIGHT+pl->index, REPEAT_DELAY );
+			timer_cancel( TIMER_LEFT+pl->index );
 		}
 	}
 	else {
-		block_right[player] = 0;
+		timer_cancel( TIMER_RIGHT+pl->index );
 	}
 	
 	if( buttons & (BTN_A|BTN_B|BTN_X|BTN_Y) ) {
-		if( !block_fire[player] ) {
-			if( !firing[player] ) {
+		if( !pl->block_fire ) {
+			if( !pl->firing ) {
 				// Fire!
-				proj[player].angle = angle[player];
-				firing[player] = true;
-				TriggerFx( PATCH_SHOOT, 0xff, true );
+				pl->proj.angle = pl->angle;
+				pl->firing = true;
+				sound_fx( PATCH_SHOOT, 0xff );
+#if PROFILE
+				// block_fire makes this a new press.
+				latency_arm( pl );
+#endif
 			}
-			block_fire[player] = true;
+			pl->block_fire = true;
 		}
 	}
 	else {
-		block_fire[player] = false;
+		pl->block_fire = false;
+	}
+
+#if PROFILE
+	// Only a new press, and only if it moved the arrow.
+	if( (buttons & ~pad_last[pl->index] & (BTN_LEFT|BTN_RIGHT)) && changed ) {
+		latency_arm( pl );
 	}
+	pad_last[pl->index] = buttons;
+#endif
 
 	return changed;
 }
 
-void draw_arrow( unsigned char x, unsigned char y, unsigned char player ) {
-	if( angle[player] >= 0 ) {
-		sprites[SPRITE_ARROW+player].tileIndex = TILE_ARROW + ((angle[player]+2)/5);
-	
-		sprites[SPRITE_ARROW+player].x = x + pgm_read_byte( arrow_x + angle[player] ) -4;
-		sprites[SPRITE_RING+player ].x = x + pgm_read_byte(  ring_x + angle[player] ) -4;
-		sprites[SPRITE_RIVET+player].x = x + pgm_read_byte( rivet_x + angle[player] ) -4;
+void draw_arrow( unsigned char x, unsigned char y, player_t *pl ) {
+	aim_t aim_at;
 
-		sprites[SPRITE_ARROW+player].y = y - pgm_read_byte( arrow_y + angle[player] ) -2;
-		sprites[SPRITE_RING+player ].y = y - pgm_read_byte(  ring_y + angle[player] ) -5;
-		sprites[SPRITE_RIVET+player].y = y - pgm_read_byte( rivet_y + angle[player] ) -3;
+	if( pl->angle >= 0 ) {
+		memcpy_P( &aim_at, aim + pl->angle, sizeof(aim_at) );
+		sprites[SPRITE_ARROW+pl->index].tileIndex = TILE_ARROW + aim_at.frame;
+
+		object_x[SPRITE_ARROW+pl->index] = x + aim_at.arrow_x -4;
+		object_x[SPRITE_RING+pl->index ] = x + aim_at.ring_x -4;
+		object_x[SPRITE_RIVET+pl->index] = x + aim_at.rivet_x -4;
 	}
 	else {
-		sprites[SPRITE_ARROW+player].tileIndex = TILE_ARROW + ((angle[player]-2)/5);
-
-		sprites[SPRITE_ARROW+player].x = x - pgm_read_byte( arrow_x - angle[player] ) -4;
-		sprites[SPRITE_RING+player ].x = x - pgm_read_byte(  ring_x - angle[player] ) -4;
-		sprites[SPRITE_RIVET+player].x = x - pgm_read_byte( rivet_x - angle[player] ) -4;
+		memcpy_P( &aim_at, aim - pl->angle, sizeof(aim_at) );
+		sprites[SPRITE_ARROW+pl->index].tileIndex = TILE_ARROW - aim_at.frame;
 
-		sprites[SPRITE_ARROW+player].y = y - pgm_read_byte( arrow_y - angle[player] ) -2;
-		sprites[SPRITE_RING+player ].y = y - pgm_read_byte(  ring_y - angle[player] ) -5;
-		sprites[SPRITE_RIVET+player].y = y - pgm_read_byte( rivet_y - angle[player] ) -3;
+		object_x[SPRITE_ARROW+pl->index] = x - aim_at.arrow_x -4;
+		object_x[SPRITE_RING+pl->index ] = x - aim_at.ring_x -4;
+		object_x[SPRITE_RIVET+pl->index] = x - aim_at.rivet_x -4;
 	}
+
+	sprites[SPRITE_ARROW+pl->index].y = y - aim_at.arrow_y -2;
+	sprites[SPRITE_RING+pl->index ].y = y - aim_at.ring_y -5;
+	sprites[SPRITE_RIVET+pl->index].y = y - aim_at.rivet_y -3;
 }
 
-void set_score( unsigned char player, long s ) {
+void set_score( player_t *pl, long s ) {
 #define MAX_SCORE 99999999
-	score[player] = s;
-	if( score[player] > MAX_SCORE ) score[player] = MAX_SCORE;
+	pl->score = s;
+	if( pl->score > MAX_SCORE ) pl->score = MAX_SCORE;
 
-	if( players == 1 ) {
-		text_write_number( 18, 16, score[player], ALIGN_RIGHT, BG_SPACE_TILE );
+	if( quiet ) {
+		return;
+	}
+	else if( players == 1 ) {
+		text_write_number( 18, 16, pl->score, ALIGN_RIGHT, BG_SPACE_TILE );
 	}
 	else {
-		text_write_number( 11+(P2_TILE_OFFSET*player), 16, score[player], ALIGN_RIGHT, BG_SPACE_TILE );
+		text_write_number( 11+(P2_TILE_OFFSET*pl->index), 16, pl->score, ALIGN_RIGHT, BG_SPACE_TILE );
 	}
 }
 
-void draw_projectile( unsigned char player ) {
+void draw_projectile( player_t *pl ) {
 	if( players == 1 ) {
-		sprites[SPRITE_PROJ_L+player].x = FIELD_OFFSET_1P + (proj[player].x>>TRAJ_SHIFT);
+		object_x[SPRITE_PROJ_L+pl->index] = FIELD_OFFSET_1P + (pl->proj.x>>TRAJ_SHIFT);
 	}
 	else {
-		sprites[SPRITE_PROJ_L+player].x = FIELD_OFFSET_2P(player) + (proj[player].x>>TRAJ_SHIFT);
+		object_x[SPRITE_PROJ_L+pl->index] = FIELD_OFFSET_2P(pl->index) + (pl->proj.x>>TRAJ_SHIFT);
 	}
-	sprites[SPRITE_PROJ_R+player].x = sprites[SPRITE_PROJ_L+player].x + TILE_WIDTH;
+	object_x[SPRITE_PROJ_R+pl->index] = object_x[SPRITE_PROJ_L+pl->index] + TILE_WIDTH;
 
-	sprites[SPRITE_PROJ_L+player].y = (FIELD_OFFSET_Y*TILE_HEIGHT) + (proj[player].y>>TRAJ_SHIFT);
-	sprites[SPRITE_PROJ_R+player].y = sprites[SPRITE_PROJ_L+player].y;
+	sprites[SPRITE_PROJ_L+pl->index].y = (FIELD_OFFSET_Y*TILE_HEIGHT) + (pl->proj.y>>TRAJ_SHIFT);
+	sprites[SPRITE_PROJ_R+pl->index].y = sprites[SPRITE_PROJ_L+pl->index].y;
 }
 
-bool board_clear( unsigned char player ) {
+bool board_clear( player_t *pl ) {
 	int b;
 
 	for( b=0 ; b < NUM_BUBBLES ; b++ ) {
-		if( bubbles[player][b] != C_BLANK ) {
+		if( pl->bubbles[b] != C_BLANK ) {
 			return false;
 		}
 	}
@@ -530,13 +1404,40 @@ unsigned char bubble_row( int b ) {
 	return row;
 }
 
+void pop_burst( player_t *pl, unsigned char colour ) {
+	// Split each popping bubble into two halves which fly apart.
+	unsigned char row, x, y;
+	int b;
+
+	if( quiet ) return;
+
+	sound_fx( PATCH_POP, 0xff );
+	for( b=0 ; b < NUM_BUBBLES ; b++ ) {
+		if( pl->bubbles[b] == C_POP ) {
+			row = bubble_row(b);
+			x = (b - FIRST_IN_ROW(row)) * BUBBLE_WIDTH;
+			if( row&1 ) x += BUBBLE_WIDTH/2;
+			if( players == 1 ) {
+				x += FIELD_OFFSET_1P;
+			}
+			else {
+				x += FIELD_OFFSET_2P(pl->index);
+			}
+			y = ((FIELD_OFFSET_Y + row + drop) * TILE_HEIGHT);
+
+			particle_spawn( x, y, -12, -32, TILE_BUBBLE_L(colour) );
+			particle_spawn( x + TILE_WIDTH, y, 12, -32, TILE_BUBBLE_R(colour) );
+		}
+	}
+}
+
 #define CHECK_MATCH(b) \
-if( bubbles[player][b] == colour ) { \
-	bubbles[player][b] = C_POP; \
+if( pl->bubbles[b] == colour ) { \
+	pl->bubbles[b] = C_POP; \
 	matches++; \
 }
 
-unsigned char pop_neighbours( unsigned char player, int b, unsigned char colour ) {
+unsigned char pop_neighbours( player_t *pl, int b, unsigned char colour ) {
 	unsigned char matches = 0;
 	unsigned char row = bubble_row(b);
 
@@ -589,40 +1490,75 @@ unsigned char pop_neighbours( unsigned char player, int b, unsigned char colour
 	return matches;
 }
 
-bool check_links( unsigned char player, int b ) {
+bool check_links( player_t *pl, int b ) {
 	// Check for links of three or more bubbles, starting from bubble "b".
-	unsigned char colour = current[player];
+	unsigned char colour = pl->current;
 	int total_matches = 1;
 	int matched = 0;
 	long points = 10;
+	bool popped = false;
 	int i;
 
 	do {
 		matched = 0;
 		for( i=0 ; i < NUM_BUBBLES ; i++ ) {
-			if( bubbles[player][i] == C_POP ) {
-				matched += pop_neighbours( player, i, colour );
+			if( pl->bubbles[i] == C_POP ) {
+				matched += pop_neighbours( pl, i, colour );
 			}
 		}
 		total_matches += matched;
 	} while( matched );
 
 	if( total_matches > 2 ) {
-		popping[player] = 1;
+		popped = true;
+		// The bubble just placed was never counted.
+		pl->colour_count[colour] -= total_matches - 1;
+		pop_burst( pl, colour );
+		if( players == 2 && total_matches >= GARBAGE_MATCHES ) {
+			i = player_ctx[pl->index^1].garbage + 1 + ((total_matches-GARBAGE_MATCHES) / GARBAGE_PER_PAIR);
+			player_ctx[pl->index^1].garbage = (i > GARBAGE_MAX) ? GARBAGE_MAX : i;
+		}
 		while( total_matches-- ) {
 			points *= 2;
 		}
-		set_score( player, score[player] + points );
+		set_score( pl, pl->score + points );
 	}
 	else {
 		for( i=0 ; i < NUM_BUBBLES ; i++ ) {
-			if( bubbles[player][i] == C_POP ) {
-				bubbles[player][i] = colour;
+			if( pl->bubbles[i] == C_POP ) {
+				pl->bubbles[i] = colour;
+			}
+		}
+		pl->colour_count[colour]++;
+	}
+
+	return popped;
+}
+
+bool push_garbage( player_t *pl ) {
+	// Push the field down a pair of rows (keeping odd and even rows in
+	// step) for each one owed, filling the top with random bubbles.
+	bool bottomed_out = false;
+	unsigned char i, row = BUBBLE_ROWS-2;
+
+	while( pl->garbage ) {
+		pl->garbage--;
+		for( i=FIRST_IN_ROW(row) ; i < NUM_BUBBLES ; i++ ) {
+			if( pl->bubbles[i] != C_BLANK ) {
+				bottomed_out = true;
 			}
 		}
+		for( i=NUM_BUBBLES-GARBAGE_BUBBLES ; i < NUM_BUBBLES ; i++ ) {
+			if( pl->bubbles[i] != C_BLANK && pl->bubbles[i] != C_POP ) pl->colour_count[pl->bubbles[i]]--;
+		}
+		memmove( pl->bubbles+GARBAGE_BUBBLES, pl->bubbles, NUM_BUBBLES-GARBAGE_BUBBLES );
+		for( i=0 ; i < GARBAGE_BUBBLES ; i++ ) {
+			pl->bubbles[i] = (game_random()%(C_COUNT-2)) + 1;
+			pl->colour_count[pl->bubbles[i]]++;
+		}
 	}
 
-	return (popping[player] != 0);
+	return bottomed_out;
 }
 
 #define PROJ_ROW(y) (((y)/BUBBLE_WIDTH)-drop)
@@ -637,29 +1573,32 @@ unsigned char proj_column( int x, unsigned char row ) {
 	return x/BUBBLE_ROWS;
 }
 
-bool update_projectile( unsigned char player ) {
+bool update_projectile( player_t *pl ) {
 	bool bottomed_out = false;
 	unsigned hit = 0;
 	int top, bottom, left, right;
 	unsigned char row;
 	int candidate;
 
-	if( firing[player] ) {
-		proj[player].y -= pgm_read_byte( traj_y + proj[player].angle );
+	if( pl->firing ) {
+		traj_t step;
+
+		memcpy_P( &step, traj + (pl->proj.angle >= 0 ? pl->proj.angle : -pl->proj.angle), sizeof(step) );
+		pl->proj.y -= step.y;
 	
-		if( proj[player].angle >= 0 ) {
+		if( pl->proj.angle >= 0 ) {
 			int edge = ((FIELD_TILES_H*TILE_WIDTH)-BUBBLE_WIDTH) << TRAJ_SHIFT;
-			proj[player].x += pgm_read_byte( traj_x + proj[player].angle );
-			if( proj[player].x >= edge ) {
-				proj[player].x = edge - (proj[player].x-edge);
-				proj[player].angle = -proj[player].angle;
+			pl->proj.x += step.x;
+			if( pl->proj.x >= edge ) {
+				pl->proj.x = edge - (pl->proj.x-edge);
+				pl->proj.angle = -pl->proj.angle;
 			}
 		}
 		else {
-			proj[player].x -= pgm_read_byte( traj_x - proj[player].angle );
-			if( proj[player].x < 0 ) {
-				proj[player].x = 0 - proj[player].x;
-				proj[player].angle = -proj[player].angle;
+			pl->proj.x -= step.x;
+			if( pl->proj.x < 0 ) {
+				pl->proj.x = 0 - pl->proj.x;
+				pl->proj.angle = -pl->proj.angle;
 			}
 		}
 	}
@@ -667,9 +1606,9 @@ bool update_projectile( unsigned char player ) {
 	// Collision check
 #define BORDER 3
 #define CENTRE(x) ((x)-BORDER+(BUBBLE_WIDTH/2))
-	top = (proj[player].y>>TRAJ_SHIFT) + BORDER;
+	top = (pl->proj.y>>TRAJ_SHIFT) + BORDER;
 	bottom = top + BUBBLE_WIDTH - (BORDER*2);
-	left = (proj[player].x>>TRAJ_SHIFT) + BORDER;
+	left = (pl->proj.x>>TRAJ_SHIFT) + BORDER;
 	right = left + BUBBLE_WIDTH - (BORDER*2);
 
 #define HIT_TOP		0x01
@@ -683,25 +1622,25 @@ bool update_projectile( unsigned char player ) {
 
 	row = PROJ_ROW( top );
 	candidate = FIRST_IN_ROW( row ) + proj_column( left, row );
-	if( candidate < NUM_BUBBLES && bubbles[player][candidate] != C_BLANK ) hit |= HIT_TOP;
+	if( candidate < NUM_BUBBLES && pl->bubbles[candidate] != C_BLANK ) hit |= HIT_TOP;
 
 	row = PROJ_ROW( top );
 	candidate = FIRST_IN_ROW( row ) + proj_column( right, row );
-	if( candidate < NUM_BUBBLES && bubbles[player][candidate] != C_BLANK ) hit |= HIT_BOTTOM;
+	if( candidate < NUM_BUBBLES && pl->bubbles[candidate] != C_BLANK ) hit |= HIT_BOTTOM;
 
 	row = PROJ_ROW( bottom );
 	candidate = FIRST_IN_ROW( row ) + proj_column( left, row );
-	if( candidate < NUM_BUBBLES && bubbles[player][candidate] != C_BLANK ) hit |= HIT_LEFT;
+	if( candidate < NUM_BUBBLES && pl->bubbles[candidate] != C_BLANK ) hit |= HIT_LEFT;
 
 	row = PROJ_ROW( bottom );
 	candidate = FIRST_IN_ROW( row ) + proj_column( right, row );
-	if( candidate < NUM_BUBBLES && bubbles[player][candidate] != C_BLANK ) hit |= HIT_RIGHT;
+	if( candidate < NUM_BUBBLES && pl->bubbles[candidate] != C_BLANK ) hit |= HIT_RIGHT;
 
 	if( hit ) {
 		row = PROJ_ROW( CENTRE(top) );
 		candidate = FIRST_IN_ROW( row ) + proj_column( CENTRE(left), row );
 
-		if( candidate < NUM_BUBBLES && bubbles[player][candidate] != C_BLANK ) {
+		if( candidate < NUM_BUBBLES && pl->bubbles[candidate] != C_BLANK ) {
 			if( hit & HIT_TOP ) {
 				row = PROJ_ROW( bottom );
 			}
@@ -719,41 +1658,47 @@ bool update_projectile( unsigned char player ) {
 			}
 		}
 
-		bubbles[player][candidate] = C_POP;			
+		pl->bubbles[candidate] = C_POP;			
 
-		if( check_links( player, candidate ) ) {
-			popping[player] = POP_SPEED;
+		if( check_links( pl, candidate ) ) {
+			timer_set( TIMER_POP+pl->index, POP_SPEED );
 		}
 		else {
 			if( candidate >= NUM_BUBBLES || row + drop >= BUBBLE_ROWS ) {
 				bottomed_out = true;
 			}
+			if( push_garbage( pl ) ) {
+				bottomed_out = true;
+			}
 		}
-		draw_field( player );
+		draw_field( pl );
 
-		new_bubble( player );
-		firing[player] = false;
+		new_bubble( pl );
+		pl->firing = false;
 	}
 
 	if( bottomed_out ) {
 		// Place the projectile where it would have been if it could be drawn as a tile.
-		proj[player].y = (BUBBLE_ROWS * BUBBLE_WIDTH) << TRAJ_SHIFT;
-		proj[player].x = (proj_column( (proj[player].x>>TRAJ_SHIFT)+(BUBBLE_WIDTH/2), row ) * BUBBLE_WIDTH) << TRAJ_SHIFT;
+		pl->proj.y = (BUBBLE_ROWS * BUBBLE_WIDTH) << TRAJ_SHIFT;
+		pl->proj.x = (proj_column( (pl->proj.x>>TRAJ_SHIFT)+(BUBBLE_WIDTH/2), row ) * BUBBLE_WIDTH) << TRAJ_SHIFT;
 		if( row & 1 ) {
-			proj[player].x += (BUBBLE_WIDTH/2) << TRAJ_SHIFT;
+			pl->proj.x += (BUBBLE_WIDTH/2) << TRAJ_SHIFT;
 		}
 	}
 
-	draw_projectile( player );
+	draw_projectile( pl );
 	return bottomed_out;
 }
 
-void update_arrow( unsigned char player ) {
-	if( player < players ) {
+void update_arrow( player_t *pl ) {
+	if( pl->index < players ) {
 		if( players == 1 ) {
-			draw_arrow(	FIELD_CENTRE_1P, ((FIELD_OFFSET_Y + FIELD_TILES_H)*TILE_HEIGHT), player );
+			draw_arrow(	FIELD_CENTRE_1P, ((FIELD_OFFSET_Y + FIELD_TILES_H)*TILE_HEIGHT), pl );
+			sprite_update( SPRITE_ARROW+pl->index );
+			sprite_update( SPRITE_RING+pl->index );
+			sprite_update( SPRITE_RIVET+pl->index );
 
-			if( angle[player] % GEAR_ANIM_STEPS == 0 ) {
+			if( pl->angle % GEAR_ANIM_STEPS == 0 ) {
 				DrawMap2( ((SCREEN_TILES_H-FIELD_TILES_H)/2) , FIELD_OFFSET_Y+FIELD_TILES_V, map_gears1 );
 			}
 			else {
@@ -761,13 +1706,16 @@ void update_arrow( unsigned char player ) {
 			}
 		}
 		else {
-			draw_arrow( FIELD_CENTRE_2P(player), (FIELD_OFFSET_Y + FIELD_TILES_H) * TILE_HEIGHT, player );
+			draw_arrow( FIELD_CENTRE_2P(pl->index), (FIELD_OFFSET_Y + FIELD_TILES_H) * TILE_HEIGHT, pl );
+			sprite_update( SPRITE_ARROW+pl->index );
+			sprite_update( SPRITE_RING+pl->index );
+			sprite_update( SPRITE_RIVET+pl->index );
 
-			if( angle[player] % GEAR_ANIM_STEPS == 0 ) {
-				DrawMap2( FIELD_OFFSET_X + (P2_TILE_OFFSET*player), FIELD_OFFSET_Y+FIELD_TILES_V, map_gears1 );
+			if( pl->angle % GEAR_ANIM_STEPS == 0 ) {
+				DrawMap2( FIELD_OFFSET_X + (P2_TILE_OFFSET*pl->index), FIELD_OFFSET_Y+FIELD_TILES_V, map_gears1 );
 			}
 			else {
-				DrawMap2( FIELD_OFFSET_X + (P2_TILE_OFFSET*player), FIELD_OFFSET_Y+FIELD_TILES_V, map_gears2 );
+				DrawMap2( FIELD_OFFSET_X + (P2_TILE_OFFSET*pl->index), FIELD_OFFSET_Y+FIELD_TILES_V, map_gears2 );
 			}
 		}
 	}
@@ -811,6 +1759,33 @@ void clear_screen_flipper( bool fade_audio ) {
 	if( fade_audio ) SetMasterVolume( 0 );
 }
 
+// Title screen animation state, advanced by title_tick().
+unsigned char bg_step;
+unsigned char shine_offset;
+bool blink;
+
+void title_start( void ) {
+	bg_step = 0;
+	shine_offset = 0;
+	blink = true;
+	timer_set( TIMER_SHINE, FPS+(FPS/2) );
+	timer_set( TIMER_BLINK, FPS/2 );
+}
+
+void title_tick( void ) {
+	timers_run();
+	if( ++bg_step == 12 ) bg_step = 0;
+	shine_offset++;
+	if( timer_fired( TIMER_SHINE ) ) {
+		shine_offset = 0;
+		timer_set( TIMER_SHINE, FPS+(FPS/2) );
+	}
+	if( timer_fired( TIMER_BLINK ) ) {
+		blink = !blink;
+		timer_set( TIMER_BLINK, FPS/2 );
+	}
+}
+
 void draw_bg( unsigned char bg_frame ) {
 	int x,y;
 
@@ -821,35 +1796,819 @@ void draw_bg( unsigned char bg_frame ) {
 	}
 }
 
+bool game_step( unsigned char *loser ) {
+	// Run one tick of the game, using the buttons in each player's pad.
+	bool game_over = false;
+	unsigned char p;
+	player_t *pl;
+
+	timers_run();
+
+	// All controls first, so that the arrows move before any field drawing.
+	for( p=0, pl=player_ctx ; p < players ; p++, pl++ ) {
+		if( proc_controls(pl) && !quiet ) {
+			update_arrow(pl);
+		}
+	}
+
+	for( p=0, pl=player_ctx ; p < players ; p++, pl++ ) {
+		if( timer_fired( TIMER_POP+p ) ) {
+			int i;
+			for( i=0 ; i<NUM_BUBBLES ; i++ ) {
+				if( pl->bubbles[i] == C_POP ) {
+					pl->bubbles[i] = C_BLANK;
+				}
+			}
+			draw_field( pl );
+			if( board_clear( pl ) ) {
+				*loser = (p+1) & 1;
+				game_over = true;
+			}
+		}
+		else if( pl->firing && !timer_running( TIMER_POP+p ) ) {
+			game_over = update_projectile(pl);
+			if( game_over ) *loser = p;
+		}
+
+		if( players == 1 && timer_fired( TIMER_WOBBLE ) ) {
+			game_over = do_wobble();
+		}
+	}
+
+	frame++;
+	return game_over;
+}
+
+// Game state snapshots, for rewinding and rolling back. Bubbles are packed
+// three bits each; C_POP doesn't fit, so popping bubbles are stored as blanks
+// plus a bit in a separate mask.
+#define SNAPSHOT_CELL_BYTES		(((NUM_BUBBLES)*3+7)/8)
+#define SNAPSHOT_POP_BYTES		(((NUM_BUBBLES)+7)/8)
+#define SNAPSHOT_PLAYER_SIZE	(SNAPSHOT_CELL_BYTES+SNAPSHOT_POP_BYTES+14+(NEXT_QUEUE/2))
+#define SNAPSHOT_SIZE			(8+(TIMER_GAME_COUNT*2)+(PLAYERS*SNAPSHOT_PLAYER_SIZE))
+
+void snapshot_save( unsigned char *buf ) {
+	unsigned char p, b, bits, mask, c;
+	unsigned int acc;
+	unsigned char *pop;
+	unsigned int ticks;
+	player_t *pl;
+
+	for( p=0, pl=player_ctx ; p < PLAYERS ; p++, pl++ ) {
+		pop = buf + SNAPSHOT_CELL_BYTES;
+		acc = 0; bits = 0; mask = 1;
+		*pop = 0;
+		for( b=0 ; b < NUM_BUBBLES ; b++ ) {
+			c = pl->bubbles[b];
+			if( c == C_POP ) {
+				*pop |= mask;
+				c = C_BLANK;
+			}
+			if( (mask <<= 1) == 0 ) {
+				*++pop = 0;
+				mask = 1;
+			}
+			acc |= c << bits;
+			bits += 3;
+			if( bits >= 8 ) {
+				*buf++ = acc;
+				acc >>= 8;
+				bits -= 8;
+			}
+		}
+		if( bits ) *buf++ = acc;
+		buf += SNAPSHOT_POP_BYTES;
+
+		*buf++ = pl->current | (pl->queue[0] << 4);
+		for( b=1 ; b < NEXT_QUEUE ; b += 2 ) {
+			*buf++ = pl->queue[b] | ((b+1 < NEXT_QUEUE) ? pl->queue[b+1] << 4 : 0);
+		}
+		*buf++ = pl->bag;
+		*buf++ = pl->angle;
+		*buf++ = pl->proj.angle;
+		memcpy( buf, &pl->proj.x, 2 ); buf += 2;
+		memcpy( buf, &pl->proj.y, 2 ); buf += 2;
+		*buf++ = pl->firing | (pl->block_fire << 1);
+		memcpy( buf, &pl->score, 4 ); buf += 4;
+		*buf++ = pl->garbage;
+	}
+
+	*buf++ = drop;
+	*buf++ = wobble_second | (wobble_count << 4);
+	// Timers are kept as time remaining, 0 when not running.
+	for( p=0 ; p < TIMER_GAME_COUNT ; p++ ) {
+		ticks = timer_remaining( p );
+		memcpy( buf, &ticks, 2 ); buf += 2;
+	}
+	memcpy( buf, &frame, 2 ); buf += 2;
+	memcpy( buf, &rng_state, 4 );
+}
+
+void snapshot_restore( const unsigned char *buf ) {
+	unsigned char p, b, bits, mask;
+	unsigned int acc;
+	const unsigned char *pop;
+	unsigned int ticks;
+	player_t *pl;
+
+	for( p=0, pl=player_ctx ; p < PLAYERS ; p++, pl++ ) {
+		pop = buf + SNAPSHOT_CELL_BYTES;
+		acc = 0; bits = 0; mask = 1;
+		for( b=0 ; b < NUM_BUBBLES ; b++ ) {
+			if( bits < 3 ) {
+				acc |= *buf++ << bits;
+				bits += 8;
+			}
+			pl->bubbles[b] = (*pop & mask) ? C_POP : (acc & 7);
+			acc >>= 3;
+			bits -= 3;
+			if( (mask <<= 1) == 0 ) {
+				pop++;
+				mask = 1;
+			}
+		}
+		buf += SNAPSHOT_POP_BYTES;
+
+		pl->current = *buf & 0x0f;
+		pl->queue[0] = *buf++ >> 4;
+		for( b=1 ; b < NEXT_QUEUE ; b += 2 ) {
+			pl->queue[b] = *buf & 0x0f;
+			if( b+1 < NEXT_QUEUE ) pl->queue[b+1] = *buf >> 4;
+			buf++;
+		}
+		pl->bag = *buf++;
+		pl->angle = *buf++;
+		pl->proj.angle = *buf++;
+		memcpy( &pl->proj.x, buf, 2 ); buf += 2;
+		memcpy( &pl->proj.y, buf, 2 ); buf += 2;
+		pl->firing = *buf & 1;
+		pl->block_fire = (*buf++ >> 1) & 1;
+		memcpy( &pl->score, buf, 4 ); buf += 4;
+		pl->garbage = *buf++;
+		colour_count_scan( pl );
+	}
+
+	drop = *buf++;
+	wobble_second = *buf & 0x0f;
+	wobble_count = *buf++ >> 4;
+	for( p=0 ; p < TIMER_GAME_COUNT ; p++ ) {
+		memcpy( &ticks, buf, 2 ); buf += 2;
+		timer_cancel( p );
+		if( ticks ) timer_arm( p, ticks );
+	}
+	memcpy( &frame, buf, 2 ); buf += 2;
+	memcpy( &rng_state, buf, 4 );
+}
+
+void redraw_player( player_t *pl ) {
+	draw_field( pl );
+	draw_next( pl, (1 << NEXT_QUEUE) - 1 );
+	update_arrow( pl );
+	draw_projectile( pl );
+	set_score( pl, pl->score );
+}
+
+#if LINK
+// Linked versus play. Both consoles run both fields in lockstep, swapping
+// one byte of input per tick over the UART. Until the other console's input
+// for a tick arrives it is predicted to be the same as last time; when it
+// does arrive, the game is rolled back to the snapshot of the last tick for
+// which both inputs were known and run forward again.
+#define LINK_WINDOW		8
+#define LINK_TAG_MASK	0x0f
+#define LINK_HELLO		0x80
+#define LINK_SEEN		0x40
+#define LINK_NONCE_MASK	0x3f
+#define LINK_LEFT		0x01
+#define LINK_RIGHT		0x02
+#define LINK_FIRE		0x04
+bool linked = false;
+unsigned char link_local;
+// Inputs of each player by tick, and the remote input each tick was run with.
+unsigned char link_input[PLAYERS][LINK_WINDOW];
+unsigned char link_used[LINK_WINDOW];
+// Next tick to run, the tick link_snapshot was taken at, and the number of
+// ticks of remote input received.
+unsigned int link_now, link_confirmed, link_remote;
+unsigned char link_snapshot[SNAPSHOT_SIZE];
+// Counters for the profiling overlay.
+unsigned char link_latency, link_latency_peak;
+unsigned char link_resim_peak;
+unsigned int link_mispredicts;
+unsigned int link_stalls;
+unsigned int link_errors;
+
+bool link_connect( void ) {
+	// Swap random nonces with the other console until each has seen the
+	// other's. The higher nonce plays on the left, and both are used to seed
+	// the random numbers, so both consoles deal the same boards.
+	unsigned char nonce = frame & LINK_NONCE_MASK, peer = 0;
+	bool seen = false, done = false;
+	int c;
+
+	UartInitRxBuffer();
+	text_write_P( 7, 14, PSTR("WAITING FOR LINK") );
+
+	while( !done ) {
+		WaitVsync(1);
+		frame++;
+		if( ReadJoypad(0) & BTN_SELECT ) return false;
+
+		while( (c = UartReadChar()) >= 0 ) {
+			if( !(c & LINK_HELLO) ) continue;
+			if( (c & LINK_NONCE_MASK) == nonce ) {
+				// Tie, try again.
+				nonce = (nonce + (frame|1)) & LINK_NONCE_MASK;
+				seen = false;
+				continue;
+			}
+			peer = c & LINK_NONCE_MASK;
+			seen = true;
+			if( c & LINK_SEEN ) done = true;
+		}
+		UartSendChar( LINK_HELLO | (seen ? LINK_SEEN : 0) | nonce );
+	}
+
+	link_local = (nonce > peer) ? 0 : 1;
+	rng_state = link_local == 0 ? ((nonce << 6) | peer) : ((peer << 6) | nonce);
+	rng_state++;
+	frame = 0;
+	return true;
+}
+
+void link_start( void ) {
+	// Called with the game set up, before the first tick.
+	link_now = link_confirmed = link_remote = 0;
+	link_latency_peak = link_resim_peak = 0;
+	link_mispredicts = link_stalls = link_errors = 0;
+	snapshot_save( link_snapshot );
+#if PROFILE
+	// The other player's presses are timed on their own console.
+	pad_local = 1 << link_local;
+#endif
+}
+
+unsigned char link_bits( int buttons ) {
+	unsigned char bits = 0;
+
+	if( buttons & BTN_LEFT ) bits |= LINK_LEFT;
+	if( buttons & BTN_RIGHT ) bits |= LINK_RIGHT;
+	if( buttons & (BTN_A|BTN_B|BTN_X|BTN_Y) ) bits |= LINK_FIRE;
+	return bits;
+}
+
+int link_buttons( unsigned char bits ) {
+	int buttons = 0;
+
+	if( bits & LINK_LEFT ) buttons |= BTN_LEFT;
+	if( bits & LINK_RIGHT ) buttons |= BTN_RIGHT;
+	if( bits & LINK_FIRE ) buttons |= BTN_A;
+	return buttons;
+}
+
+bool link_tick( unsigned int t, unsigned char *loser ) {
+	unsigned char remote = link_local ^ 1;
+	unsigned char in = 0;
+
+	if( t < link_remote ) {
+		in = link_input[remote][t & (LINK_WINDOW-1)];
+	}
+	else if( link_remote ) {
+		in = link_input[remote][(link_remote-1) & (LINK_WINDOW-1)];
+	}
+	link_used[t & (LINK_WINDOW-1)] = in;
+
+	player_ctx[link_local].pad = link_buttons( link_input[link_local][t & (LINK_WINDOW-1)] );
+	player_ctx[remote].pad = link_buttons( in );
+	return game_step( loser );
+}
+
+bool link_frame( unsigned char *loser ) {
+	unsigned char remote = link_local ^ 1;
+	unsigned char local = link_bits( ReadJoypad(0) );
+	unsigned int t, confirm;
+	bool mispredicted = false;
+	int c;
+
+	// Take in what the other console has sent, as long as there's room.
+	while( link_remote - link_confirmed < LINK_WINDOW && (c = UartReadChar()) >= 0 ) {
+		if( c & LINK_HELLO ) continue;
+		if( ((c >> 3) & LINK_TAG_MASK) != (link_remote & LINK_TAG_MASK) ) {
+			link_errors++;
+			continue;
+		}
+		if( link_remote < link_now && (c & 7) != link_used[link_remote & (LINK_WINDOW-1)] ) {
+			mispredicted = true;
+		}
+		link_input[remote][link_remote & (LINK_WINDOW-1)] = c & 7;
+		link_remote++;
+	}
+
+	// Roll back and re-run the ticks since the last snapshot, taking a new
+	// one at the last tick with both inputs known.
+	confirm = (link_remote < link_now) ? link_remote : link_now;
+	if( mispredicted || (confirm > link_confirmed && confirm < link_now) ) {
+		snapshot_restore( link_snapshot );
+		quiet = true;
+		for( t=link_confirmed ; t < link_now ; t++ ) {
+			if( t == confirm ) {
+				snapshot_save( link_snapshot );
+				link_confirmed = t;
+			}
+			if( link_tick( t, loser ) && t < link_remote ) {
+				quiet = false;
+				return true;
+			}
+		}
+		quiet = false;
+
+		if( link_now - confirm > link_resim_peak ) {
+			link_resim_peak = link_now - confirm;
+		}
+		if( mispredicted ) {
+			link_mispredicts++;
+			redraw_player( &player_ctx[0] );
+			redraw_player( &player_ctx[1] );
+		}
+	}
+
+	// Run this tick, unless we're too far ahead of the other console.
+	if( link_now - link_confirmed < LINK_WINDOW ) {
+		link_input[link_local][link_now & (LINK_WINDOW-1)] = local;
+		UartSendChar( ((link_now & LINK_TAG_MASK) << 3) | local );
+		// A game over is only final once the other console's input is known.
+		if( link_tick( link_now++, loser ) && link_now <= link_remote ) {
+			return true;
+		}
+	}
+	else {
+		link_stalls++;
+	}
+
+	if( link_now <= link_remote ) {
+		snapshot_save( link_snapshot );
+		link_confirmed = link_now;
+	}
+
+	link_latency = (link_now > link_remote) ? link_now - link_remote : 0;
+	if( link_latency > link_latency_peak ) {
+		link_latency_peak = link_latency;
+	}
+
+	return false;
+}
+
+#if PROFILE
+void link_prof_draw( void ) {
+	prof_number( 1, PROF_Y+1, link_latency, 2 );
+	prof_number( 4, PROF_Y+1, link_latency_peak, 2 );
+	prof_number( 7, PROF_Y+1, link_resim_peak, 2 );
+	prof_number( 12, PROF_Y+1, link_mispredicts, 4 );
+	prof_number( 17, PROF_Y+1, link_stalls, 4 );
+	prof_number( 22, PROF_Y+1, link_errors, 4 );
+}
+#endif
+#endif
+
+#if PROFILE
+// Cycle counts are measured from the idle time left in a frame, calibrated
+// against a delay loop of known length, so that time lost to the video
+// interrupt is included just as it would be in the game loop.
+#define BENCH_CALIBRATE	10000
+
+unsigned int prof_spin( void ) {
+	// Idle until the next vsync, counting loop iterations.
+	unsigned int n = 0;
+
+	while( !GetVsyncFlag() ) n++;
+	ClearVsyncFlag();
+	return n;
+}
+
+unsigned long bench_cycles( unsigned int idle, unsigned int busy, unsigned int calibrated ) {
+	return ((unsigned long)(idle-busy)*(4UL*BENCH_CALIBRATE)) / (idle-calibrated);
+}
+
+void bench_run( void ) {
+	static unsigned char buf[SNAPSHOT_SIZE];
+	unsigned int idle, saved, restored, drawn, calibrated;
+	unsigned char i;
+
+#define BENCH_REPEAT 8
+	WaitVsync(1);
+	idle = prof_spin();
+	_delay_loop_2( BENCH_CALIBRATE );
+	calibrated = prof_spin();
+	for( i=0 ; i < BENCH_REPEAT ; i++ ) snapshot_save( buf );
+	saved = prof_spin();
+	for( i=0 ; i < BENCH_REPEAT ; i++ ) snapshot_restore( buf );
+	restored = prof_spin();
+	// A single field redraw is close to a frame's worth of work already.
+	for( i=0 ; i < FIELD_TILES_V ; i++ ) draw_field_row( &player_ctx[0], i );
+	drawn = prof_spin();
+
+	ClearVram();
+	text_write_P( 2, 2, PSTR("SNAPSHOT BYTES") );
+	text_write_number( 24, 2, SNAPSHOT_SIZE, ALIGN_RIGHT, TEXT_DIGIT_TILE );
+	text_write_P( 2, 4, PSTR("SAVE CYCLES") );
+	text_write_number( 24, 4, bench_cycles( idle, saved, calibrated ) / BENCH_REPEAT, ALIGN_RIGHT, TEXT_DIGIT_TILE );
+	text_write_P( 2, 6, PSTR("RESTORE CYCLES") );
+	text_write_number( 24, 6, bench_cycles( idle, restored, calibrated ) / BENCH_REPEAT, ALIGN_RIGHT, TEXT_DIGIT_TILE );
+	text_write_P( 2, 8, PSTR("FIELD CYCLES") );
+	text_write_number( 24, 8, bench_cycles( idle, drawn, calibrated ), ALIGN_RIGHT, TEXT_DIGIT_TILE );
+	text_write_P( 2, 10, PSTR("GLOBAL BYTES") );
+	text_write_number( 24, 10, &_end - (unsigned char*)RAMSTART, ALIGN_RIGHT, TEXT_DIGIT_TILE );
+	text_write_P( 2, 12, PSTR("STACK FREE") );
+	text_write_number( 24, 12, stack_free(), ALIGN_RIGHT, TEXT_DIGIT_TILE );
+	text_write_P( 2, 14, PSTR("STACK STATIC") );
+	text_write_number( 24, 14, STACK_STATIC, ALIGN_RIGHT, TEXT_DIGIT_TILE );
+
+	while( !(ReadJoypad(0) & BTN_START) );
+	while( ReadJoypad(0) & BTN_START );
+}
+#endif
+
+unsigned char hiscore_checksum( hiscore_table_t *table ) {
+	unsigned char *p = (unsigned char*)table;
+	unsigned char sum = 0xa5;
+
+	while( p < &table->checksum ) {
+		sum += *p++;
+	}
+	return sum;
+}
+
+unsigned int hiscore_find_block( unsigned int id ) {
+	unsigned int addr;
+
+	for( addr=0 ; addr < EEPROM_BLOCKS*EEPROM_BLOCK_SIZE ; addr += EEPROM_BLOCK_SIZE ) {
+		if( eeprom_read_word( (const uint16_t*)addr ) == id ) {
+			return addr;
+		}
+	}
+	return 0;
+}
+
+void hiscore_init( void ) {
+	struct EepromBlockStruct block;
+	hiscore_table_t slot;
+	bool found = false;
+	unsigned char s, i;
+
+	for( i=0 ; i < HISCORE_ENTRIES ; i++ ) {
+		hiscores.entry[i].name[0] = 'U';
+		hiscores.entry[i].name[1] = 'Z';
+		hiscores.entry[i].name[2] = 'E';
+		hiscores.entry[i].score = 10000 >> i;
+	}
+	hiscores.seq = 0;
+
+	if( !isEepromFormatted() ) return;
+
+	for( s=0 ; s < HISCORE_SLOTS ; s++ ) {
+		hiscore_addr[s] = hiscore_find_block( HISCORE_BLOCK_ID+s );
+		if( !hiscore_addr[s] ) {
+			// First run: claim a block. This blocks for a while, but only once.
+			block.id = HISCORE_BLOCK_ID+s;
+			for( i=0 ; i < sizeof(block.data) ; i++ ) {
+				block.data[i] = 0;
+			}
+			if( EepromWriteBlock( &block ) == 0 ) {
+				hiscore_addr[s] = hiscore_find_block( HISCORE_BLOCK_ID+s );
+			}
+		}
+		if( hiscore_addr[s] ) {
+			for( i=0 ; i < sizeof(slot) ; i++ ) {
+				((unsigned char*)&slot)[i] = eeprom_read_byte( (const uint8_t*)(hiscore_addr[s]+2+i) );
+			}
+			if( slot.checksum == hiscore_checksum( &slot )
+				&& ( !found || (signed char)(slot.seq - hiscores.seq) > 0 ) ) {
+				hiscores = slot;
+				hiscore_slot = s;
+				found = true;
+			}
+		}
+	}
+}
+
+void hiscore_save( void ) {
+	// Queue the table to be written by hiscore_tick(). An interrupted write
+	// is restarted in the same slot, keeping the previous one intact.
+	if( hiscore_pos == sizeof(hiscores) ) {
+		hiscore_slot = (hiscore_slot+1) % HISCORE_SLOTS;
+	}
+	hiscores.seq++;
+	hiscores.checksum = hiscore_checksum( &hiscores );
+	hiscore_pos = 0;
+}
+
+void hiscore_tick( void ) {
+	// Write at most one byte per call. Each byte takes a few milliseconds
+	// to program, so we never wait on the EEPROM; the checksum goes last.
+	if( hiscore_pos < sizeof(hiscores) && eeprom_is_ready() ) {
+		if( hiscore_addr[hiscore_slot] ) {
+			uint8_t *addr = (uint8_t*)(hiscore_addr[hiscore_slot] + 2 + hiscore_pos);
+			unsigned char value = ((unsigned char*)&hiscores)[hiscore_pos];
+
+			if( eeprom_read_byte( addr ) != value ) {
+				eeprom_write_byte( addr, value );
+			}
+		}
+		hiscore_pos++;
+	}
+}
+
+unsigned char hiscore_rank( long s ) {
+	unsigned char rank = 0;
+
+	while( rank < HISCORE_ENTRIES && hiscores.entry[rank].score >= s ) {
+		rank++;
+	}
+	return rank;
+}
+
+void hiscore_draw_entry( char x, char y, unsigned char rank ) {
+	char name[HISCORE_NAME_LEN+1];
+	unsigned char i;
+
+	for( i=0 ; i < HISCORE_NAME_LEN ; i++ ) {
+		name[i] = hiscores.entry[rank].name[i];
+	}
+	name[i] = 0;
+	text_write( x, y, name );
+	text_write_number( x+HISCORE_NAME_LEN+9, y, hiscores.entry[rank].score, ALIGN_RIGHT, TEXT_DIGIT_TILE );
+}
+
+void hiscore_enter( player_t *pl, unsigned char pad ) {
+	// Let a player put their initials against a new high score, using the
+	// controller in port "pad".
+	unsigned char rank = hiscore_rank( pl->score );
+	unsigned char i, pos = 0;
+	int buttons, last = 0xffff;
+	hiscore_t *entry;
+
+	if( rank >= HISCORE_ENTRIES ) return;
+
+	for( i=HISCORE_ENTRIES-1 ; i > rank ; i-- ) {
+		hiscores.entry[i] = hiscores.entry[i-1];
+	}
+	entry = &hiscores.entry[rank];
+	entry->name[0] = entry->name[1] = entry->name[2] = 'A';
+	entry->score = pl->score;
+
+	ClearVram();
+	title_start();
+	text_write_P( 6, 3, players == 1 ? PSTR("NEW HIGH SCORE!") : PSTR("PLAYER   HIGH SCORE!") );
+	if( players > 1 ) SetTile( 13, 3, TEXT_DIGIT_TILE + pl->index + 1 );
+
+	while( pos < HISCORE_NAME_LEN ) {
+		WaitVsync(1);
+		hiscore_tick();
+		title_tick();
+		frame++;
+
+		for( i=0 ; i < HISCORE_ENTRIES ; i++ ) {
+			hiscore_draw_entry( 8, 6+(i*2), i );
+		}
+		if( blink ) {
+			SetTile( 8+pos, 6+(rank*2), 0 );
+		}
+
+		buttons = ReadJoypad(pad);
+		if( buttons & ~last & BTN_UP ) {
+			if( ++entry->name[pos] > 'Z' ) entry->name[pos] = 'A';
+		}
+		else if( buttons & ~last & BTN_DOWN ) {
+			if( --entry->name[pos] < 'A' ) entry->name[pos] = 'Z';
+		}
+		else if( buttons & ~last & BTN_LEFT ) {
+			if( pos ) pos--;
+		}
+		else if( buttons & ~last & (BTN_RIGHT|BTN_A|BTN_START) ) {
+			pos++;
+		}
+		last = buttons;
+	}
+
+	hiscore_draw_entry( 8, 6+(rank*2), rank );
+	hiscore_save();
+	WaitVsync(60);
+}
+
+// Attract mode. A demo is a 4-byte RNG seed followed by player one's
+// buttons, one byte per run of identical game ticks: the top five bits are
+// the run length less one, the bottom three the buttons below. Decoded a
+// byte at a time straight from flash as the game asks for input.
+#define DEMO_LEFT		1
+#define DEMO_RIGHT		2
+#define DEMO_FIRE		4
+#define DEMO_BUTTONS	7
+#define DEMO_RUN_SHIFT	3
+#define DEMO_RUN_MAX	32
+#define DEMO_END		0xff
+// Title loop passes (every third field) before a demo starts.
+#define DEMO_IDLE		400
+#ifndef DEMO_RECORD
+#define DEMO_RECORD 0
+#endif
+const char * const demos[] PROGMEM = { demo_0, demo_1 };
+#define DEMOS (sizeof(demos)/sizeof(demos[0]))
+// The demos are button presses, so they only play the same game with the
+// aiming tables they were recorded with. Built with other ANGLES,
+// TRAJ_SHIFT or SHOT_SPEED options, attract mode is left out.
+#define DEMOS_PLAYABLE	(ANGLES == DEMO_ANGLES && TRAJ_SHIFT == DEMO_TRAJ_SHIFT && TRAJ_STEP == DEMO_TRAJ_STEP)
+bool demo = false;
+unsigned char demo_next = 0;
+const char *demo_pos;
+unsigned char demo_run;
+unsigned char demo_bits;
+// The player count chosen before the demo took over.
+unsigned char demo_players;
+
+void demo_start( void ) {
+	// Runs before game_setup(), so the board comes out as recorded.
+	const char *d = (const char*)pgm_read_word( &demos[demo_next] );
+
+	if( ++demo_next == DEMOS ) demo_next = 0;
+	rng_state = pgm_read_dword( d );
+	demo_pos = d + 4;
+	demo_run = 0;
+	frame = 0;
+	demo_players = players;
+	players = 1;
+}
+
+void demo_end( void ) {
+	players = demo_players;
+}
+
+int demo_pad( void ) {
+	// Buttons for the next tick, or -1 when the recording runs out.
+	unsigned char c;
+	int buttons = 0;
+
+	if( !demo_run ) {
+		c = pgm_read_byte( demo_pos );
+		if( c == DEMO_END ) return -1;
+		demo_pos++;
+		demo_run = (c >> DEMO_RUN_SHIFT) + 1;
+		demo_bits = c & DEMO_BUTTONS;
+	}
+	demo_run--;
+
+	if( demo_bits & DEMO_LEFT ) buttons |= BTN_LEFT;
+	if( demo_bits & DEMO_RIGHT ) buttons |= BTN_RIGHT;
+	if( demo_bits & DEMO_FIRE ) buttons |= BTN_A;
+	return buttons;
+}
+
+#if DEMO_RECORD
+// "make DEMO_RECORD=1" sends player one's games out of the UART in the
+// format above, ready to be pasted into data/demos.inc.
+void demo_record_byte( unsigned char c ) {
+	while( IsUartTxBufferFull() );
+	UartSendChar( c );
+}
+
+void demo_record_start( void ) {
+	unsigned char i;
+
+	frame = 0;
+	demo_run = 0;
+	for( i=0 ; i < 4 ; i++ ) {
+		demo_record_byte( rng_state >> (i*8) );
+	}
+}
+
+void demo_record( int buttons ) {
+	unsigned char bits = 0;
+
+	if( buttons & BTN_LEFT ) bits |= DEMO_LEFT;
+	if( buttons & BTN_RIGHT ) bits |= DEMO_RIGHT;
+	if( buttons & (BTN_A|BTN_B|BTN_X|BTN_Y) ) bits |= DEMO_FIRE;
+
+	// A full run of all three buttons would read back as DEMO_END.
+	if( demo_run && (bits != demo_bits || demo_run == DEMO_RUN_MAX
+			|| (demo_run == DEMO_RUN_MAX-1 && bits == DEMO_BUTTONS)) ) {
+		demo_record_byte( ((demo_run-1) << DEMO_RUN_SHIFT) | demo_bits );
+		demo_run = 0;
+	}
+	demo_bits = bits;
+	demo_run++;
+}
+
+void demo_record_end( void ) {
+	if( demo_run ) {
+		demo_record_byte( ((demo_run-1) << DEMO_RUN_SHIFT) | demo_bits );
+	}
+	demo_record_byte( DEMO_END );
+}
+#endif
+
+void game_setup( void ) {
+	// Fresh fields, arrows and counters for a game of "players".
+	unsigned char p, i;
+
+	for( p=0 ; p < PLAYERS ; p++ ) {
+		player_ctx[p].index = p;
+	}
+	// Both players start from the same board.
+	memset( player_ctx[0].bubbles, C_BLANK, NUM_BUBBLES );
+	board_generate( player_ctx[0].bubbles, START_ROWS, C_COUNT-2, game_random() );
+	memcpy( player_ctx[1].bubbles, player_ctx[0].bubbles, NUM_BUBBLES );
+
+	drop = 0;
+
+	memset( field_dirty, 0, sizeof(field_dirty) );
+	if( players == 1 ) {
+		draw_map_flipper( 0, 0, map_field_1p );
+		draw_field( &player_ctx[0] );
+	}
+	else {
+		draw_map_flipper( 0, 0, map_field_2p );
+		draw_field( &player_ctx[0] );
+		draw_field( &player_ctx[1] );
+	}
+
+	for( p=0 ; p<PLAYERS ; p++ ) {
+		if( p < players ) {
+			player_t *pl = &player_ctx[p];
+
+			// Tile indices of arrow parts.
+			sprites[SPRITE_ARROW+p].tileIndex = TILE_ARROW;
+			sprites[SPRITE_RING +p].tileIndex = TILE_RING;
+			sprites[SPRITE_RIVET+p].tileIndex = TILE_RIVET;
+
+			pl->firing = false;
+			pl->garbage = 0;
+			pl->bag = 0;
+			colour_count_scan( pl );
+			// Fill the queue, then take current from the front of it.
+			for( i=0 ; i <= NEXT_QUEUE ; i++ ) {
+				new_bubble( pl );
+			}
+			draw_projectile(pl);
+	
+			pl->angle = 0;
+			update_arrow(pl);
+			set_score( pl, 0 );
+		}
+	}
+
+	timers_reset();
+	if( players == 1 ) wobble_start();
+	ram_tiles_peak = 0;
+	sprites_dropped = 0;
+	particles_clear();
+	particles_dropped = 0;
+#if PROFILE
+	memset( latency_hist, 0, sizeof(latency_hist) );
+	memset( latency_pending, 0, sizeof(latency_pending) );
+	pad_local = demo ? 0 : (1 << players) - 1;
+#endif
+}
+
 int main(){
 	int p = 0;
+	unsigned int idle;
 	bool game_over;
 	unsigned char loser = 0;
+#if LINK
+	unsigned int ticked;
+	bool stalled = false;
+#endif
 
 	InitMusicPlayer(patches);
+	SetUserPostVsyncCallback( sound_tick );
+	hiscore_init();
+#if PROFILE
+	stack_paint();
+	SetTileTable(title_tiles);
+	bench_run();
+#endif
 
 	while(1) {
 		SetTileTable(title_tiles);
 		SetSpritesTileTable(sprite_tiles);
 		ClearVram();
 		SetSpriteVisibility(false);
-		for( p=0 ; p < MAX_SPRITES ; p++ ) {
-			sprites[p].x = SCREEN_TILES_H*TILE_WIDTH;
-		}
+		sprite_hide_all();
 
 		frame = 0;
 		p = 1;
+		idle = 0;
+		demo = false;
+		timers_reset();
+		title_start();
 		SetMasterVolume( MASTER_VOLUME );
-		StartSong( title_song );
+		song_play( title_music );
 		WaitVsync(60);
 		FadeIn(1,false);
 		while( 1 ) {
-			unsigned char shine_offset;
 			WaitVsync(3);
-			draw_bg( frame % 12 );
+			draw_bg( bg_step );
 			DrawMap2( 3,4, map_title );
 
-			shine_offset = frame%(FPS+(FPS/2));
 			if( shine_offset < 22 ) {
 				SetTile( 4+shine_offset, 4, TILE_SHINE_TOP );
 			}
@@ -863,13 +2622,16 @@ int main(){
 				SetTile( 4+shine_offset-7-2, 8, TILE_SHINE_BOTTOM );
 			}
 
-			if( frame % FPS < FPS/2 ) {
-				text_write( 10,12, "PUSH START" );
+			if( blink ) {
+				text_write_P( 10,12, PSTR("PUSH START") );
 			}
-			text_write( 5,16, "c2011 STEVE MADDISON" );
+			text_write_P( 5,16, PSTR("c2011 STEVE MADDISON") );
+			text_write_P( 6,14, PSTR("HI") );
+			hiscore_draw_entry( 9,14, 0 );
+			hiscore_tick();
 
+			title_tick();
 			frame++;
-			if( frame % (FPS*12) == 0 ) frame = 0;
 
 			if( ReadJoypad(0) & BTN_START ) {
 				if( !p ) break;
@@ -877,17 +2639,23 @@ int main(){
 			else {
 				p = 0;
 			}
+			if( ReadJoypad(0) || ReadJoypad(1) ) {
+				idle = 0;
+			}
+			else if( DEMOS_PLAYABLE && ++idle == DEMO_IDLE ) {
+				demo = true;
+				break;
+			}
 		}
 
 		// Select number of players...
 		p = 1;
-		while(1) {
-			unsigned char shine_offset;
+		while( !demo ) {
 			int buttons;
 			WaitVsync(3);
-			draw_bg( frame % 12 );
+			draw_bg( bg_step );
+			title_tick();
 			frame++;
-			if( frame % (FPS*12) == 0 ) frame = 0;
 
 			if( players == 1 ) {
 				DrawMap2( 2, 4, map_player_selected );
@@ -900,9 +2668,8 @@ int main(){
 			DrawMap2( 4, 5, map_1_player );
 			DrawMap2( 4+P2_TILE_OFFSET, 5, map_2_player );
 
-			text_write( 8,14, "SELECT PLAYERS" );
+			text_write_P( 8,14, PSTR("SELECT PLAYERS") );
 
-			shine_offset = frame%(FPS+(FPS/2));
 			if( shine_offset < 10 ) {
 				SetTile( 3+shine_offset+(P2_TILE_OFFSET*(players-1)), 4, TILE_SHINE_TOP );
 			}
@@ -916,6 +2683,7 @@ int main(){
 				SetTile( 3+shine_offset+(P2_TILE_OFFSET*(players-1))-7-2, 10, TILE_SHINE_BOTTOM );
 			}
 
+			hiscore_tick();
 			buttons = ReadJoypad(0);
 			if( buttons & BTN_LEFT ) {
 				players = 1;
@@ -939,112 +2707,122 @@ int main(){
 			}
 		};
 
-		clear_screen_flipper( true );
-		StopSong();
-		SetTileTable(bg_tiles);
-
-		for( p = 0 ; p < NUM_BUBBLES ; p++ ) {
-			bubbles[0][p] = C_BLANK;
-			bubbles[1][p] = C_BLANK;
+#if LINK
+		// In linked builds, two players means one on each console.
+		linked = false;
+		if( players == 2 && !demo ) {
+			if( !link_connect() ) continue;
+			linked = true;
 		}
-		for( p = 0 ; p < (3*8)+(2*7) ; p++ ) {
-			bubbles[0][p] = random()%(C_COUNT-1);
-			bubbles[1][p] = random()%(C_COUNT-1);
-		}
-
-		drop = 0;
+#endif
 
-		if( players == 1 ) {
-			draw_map_flipper( 0, 0, map_field_1p );
-			draw_field(0);
-		}
-		else {
-			draw_map_flipper( 0, 0, map_field_2p );
-			draw_field(0);
-			draw_field(1);
-		}
-
-		for( p=0 ; p<PLAYERS ; p++ ) {
-			if( p < players ) {
-				// Tile indices of arrow parts.
-				sprites[SPRITE_ARROW+p].tileIndex = TILE_ARROW;
-				sprites[SPRITE_RING +p].tileIndex = TILE_RING;
-				sprites[SPRITE_RIVET+p].tileIndex = TILE_RIVET;
-
-				firing[p] = false;
-				popping[p] = 0;
-				new_bubble(p); // Initialize next	
-				new_bubble(p); // Initialise current and next
-				draw_projectile(p);
-		
-				angle[p] = 0;
-				update_arrow(p);
-				set_score( p, 0 );
-			}
-		}
+		clear_screen_flipper( true );
+		song_stop();
+		SetTileTable(bg_tiles);
 
-		wobble_timer = -WOBBLE_DELAY;
+		if( demo ) demo_start();
+#if DEMO_RECORD
+		else if( players == 1 ) demo_record_start();
+#endif
+		game_setup();
 		game_over = false;
-	
+
+#if LINK
+		if( linked ) link_start();
+#endif
+		sprite_commit();
 		SetSpriteVisibility(true);
 		SetMasterVolume( MASTER_VOLUME );
-		StartSong( title_song );
+		song_play( title_music );
 
 		while(!game_over) {
-			if( frame & 1 ) WaitVsync(1);
-
-			for( p=0 ; p < players ; p++ ) {
-				if( proc_controls(p) ) {
-					update_arrow(p);
-				}
+#if LINK
+			// A pass that ran no tick still takes its field, or particles,
+			// effects and sprites would race ahead while the other console
+			// catches up.
+			if( (frame & 1) || stalled ) {
+#else
+			if( frame & 1 ) {
+#endif
+				WaitVsync(1);
+				field_rows_left = FIELD_ROW_BUDGET;
+				hiscore_tick();
+			}
 
-				if( popping[p] ) {
-					popping[p]--;
-					if( popping[p] == 0 ) {
-						int i;
-						for( i=0 ; i<NUM_BUBBLES ; i++ ) {
-							if( bubbles[p][i] == C_POP ) {
-								bubbles[p][i] = C_BLANK;
-							}
-						}
-						draw_field( p );
-						if( board_clear( p ) ) {
-							loser = (p+1) & 1;
-							game_over = true;
-						}
-					}
-				}
-				else if( firing[p] ) {
-					game_over = update_projectile(p);
-					if( game_over ) loser = p;
+#if PROFILE
+			// The kernel latches the pads at each vsync.
+			pad_latched = vsync_count;
+#endif
+#if LINK
+			if( linked ) {
+				ticked = frame;
+				game_over = link_frame( &loser );
+				stalled = (frame == ticked);
+			}
+			else
+#endif
+			if( demo ) {
+				// Any button takes over from the demo.
+				p = demo_pad();
+				if( p < 0 || ReadJoypad(0) || ReadJoypad(1) ) break;
+				player_ctx[0].pad = p;
+				game_over = game_step( &loser );
+			}
+			else {
+				for( p=0 ; p < players ; p++ ) {
+					player_ctx[p].pad = ReadJoypad(p);
 				}
+#if DEMO_RECORD
+				if( players == 1 ) demo_record( player_ctx[0].pad );
+#endif
+				game_over = game_step( &loser );
+			}
 
-				if( players == 1 && ++wobble_timer > 0 ) {
-					game_over = do_wobble();
-				}
+			field_flush();
+			particles_update();
+			particles_draw();
+			sprite_commit();
+			fx_commit();
+#if PROFILE
+			if( (frame & 7) == 0 ) {
+				prof_draw();
+#if LINK
+				if( linked ) link_prof_draw();
+#endif
 			}
+#endif
+		}
 
-			frame++;
+		if( demo ) {
+			demo_end();
+			song_stop();
+			SetSpriteVisibility(false);
+			clear_screen_flipper( true );
+			continue;
 		}
+#if DEMO_RECORD
+		if( players == 1 ) demo_record_end();
+#endif
 
 		// Game over
-		StopSong();
+		field_finish();
+		song_stop();
 		if( players == 1 ) {
 			if( loser == 0 ) {
 				DrawMap2( (SCREEN_TILES_H-FIELD_TILES_H)/2, FIELD_OFFSET_Y+(FIELD_TILES_V/2)-2, map_lose );
-				TriggerFx( PATCH_LOSE, 0xff, true );
+				sound_fx( PATCH_LOSE, 0xff );
 			}
 			else {
 				DrawMap2( (SCREEN_TILES_H-FIELD_TILES_H)/2, FIELD_OFFSET_Y+(FIELD_TILES_V/2)-2, map_win );
-				TriggerFx( PATCH_WIN1, 0xff, true );
-				TriggerFx( PATCH_WIN2, 0xff, true );
+				sound_fx( PATCH_WIN1, 0xff );
+				sound_fx( PATCH_WIN2, 0xff );
 			}
 		}
 		else {
 			if( loser == 0 ) {
 				DrawMap2( FIELD_OFFSET_X, FIELD_OFFSET_Y+(FIELD_TILES_V/2)-2, map_lose );
 				DrawMap2( FIELD_OFFSET_X+P2_TILE_OFFSET, FIELD_OFFSET_Y+(FIELD_TILES_V/2)-2, map_win );
-				if( firing[1] ) {
+				if( player_ctx[1].firing ) {
 					// Hide opponent's projectile.
 					sprites[SPRITE_PROJ_L+1].tileIndex = 0;
 					sprites[SPRITE_PROJ_R+1].tileIndex = 0;
@@ -1053,20 +2831,35 @@ int main(){
 			else {
 				DrawMap2( FIELD_OFFSET_X, FIELD_OFFSET_Y+(FIELD_TILES_V/2)-2, map_win );
 				DrawMap2( FIELD_OFFSET_X+P2_TILE_OFFSET, FIELD_OFFSET_Y+(FIELD_TILES_V/2)-2, map_lose );
-				if( firing[0] ) {
+				if( player_ctx[0].firing ) {
 					sprites[SPRITE_PROJ_L].tileIndex = 0;
 					sprites[SPRITE_PROJ_R].tileIndex = 0;
 				}
 			}
-			TriggerFx( PATCH_WIN1, 0xff, true );
-			TriggerFx( PATCH_WIN2, 0xff, true );
+			sound_fx( PATCH_WIN1, 0xff );
+			sound_fx( PATCH_WIN2, 0xff );
+			sprite_commit();
 		}
+		fx_commit();
 		WaitVsync(60);
 		
 		while( ReadJoypad(0) != 0 || ReadJoypad(1) != 0 );
 		while( ReadJoypad(0) == 0 && ReadJoypad(1) == 0 );
 		SetSpriteVisibility(false);
 		clear_screen_flipper( true );
+
+		SetTileTable(title_tiles);
+		for( p=0 ; p < players ; p++ ) {
+#if LINK
+			// Only the player at this console gets to enter a name, on
+			// pad 0 as they played; the other does so on their own.
+			if( linked ) {
+				if( p == link_local ) hiscore_enter( &player_ctx[p], 0 );
+				continue;
+			}
+#endif
+			hiscore_enter( &player_ctx[p], p );
+		}
 	}
 }
 
@@ -0,0 +1,111 @@
+/*
+ *  A bubbly puzzle game for the Uzebox
+ *  Copyright (C) 2011  Steve Maddison
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Starting board generator, shared by the game and tools/boardgen so that a
+ * seed gives the same board on both. Rows alternate between BOARD_WIDE and
+ * BOARD_WIDE-1 bubbles, stored one after the other as in the game's field,
+ * and are filled completely so that every bubble hangs from the ceiling.
+ * Filling goes once through the cells in order, picking for each a colour
+ * that
+ *   - doesn't complete a group of three with the bubbles already placed
+ *     next to it (so nothing pops before the first shot), and
+ *   - hasn't been used more than BOARD_COLOUR_MAX( cells, colours ) times.
+ */
+
+#ifndef BOARD_H
+#define BOARD_H
+
+#include <stdint.h>
+
+#define BOARD_WIDE		8
+#define BOARD_CELLS(rows)	((((rows)+1)/2)*BOARD_WIDE + ((rows)/2)*(BOARD_WIDE-1))
+#define BOARD_COLOUR_MAX(cells,colours)	(((cells)+(colours)-1)/(colours) + 1)
+#define BOARD_MAX_COLOURS	8
+
+static uint16_t board_random( uint32_t *seed ) {
+	// Fixed size LCG, so the sequence is the same everywhere.
+	*seed = (*seed * 1103515245UL) + 12345UL;
+	return (uint16_t)(*seed >> 16);
+}
+
+static unsigned char board_generate( unsigned char *cells, unsigned char rows, unsigned char colours, uint32_t seed ) {
+	// Fills cells with colours 1..colours and returns how many there are.
+	unsigned char count[BOARD_MAX_COLOURS+1];
+	// Size of the group each cell belongs to so far, 1 or 2.
+	unsigned char group[BOARD_CELLS(12)];
+	unsigned char total = BOARD_CELLS(rows);
+	unsigned char max = BOARD_COLOUR_MAX( total, colours );
+	unsigned char row, column, width, b = 0, above = 0;
+	unsigned char i, c, pass;
+	unsigned char near[3], n;
+
+	for( i=0 ; i <= colours ; i++ ) count[i] = 0;
+
+	for( row=0 ; row < rows ; row++ ) {
+		width = (row & 1) ? BOARD_WIDE-1 : BOARD_WIDE;
+		for( column=0 ; column < width ; column++, b++ ) {
+			// Neighbours placed already: left, and the two above.
+			n = 0;
+			if( column > 0 ) near[n++] = b-1;
+			if( row > 0 ) {
+				if( row & 1 ) {
+					near[n++] = above + column;
+					near[n++] = above + column + 1;
+				}
+				else {
+					if( column > 0 ) near[n++] = above + column - 1;
+					if( column < BOARD_WIDE-1 ) near[n++] = above + column;
+				}
+			}
+
+			// Start somewhere random and take the first colour that fits,
+			// relaxing the histogram limit if nothing does. With fewer than
+			// four colours there may be nothing at all, so keep the first.
+			c = board_random( &seed ) % colours;
+			cells[b] = c+1;
+			group[b] = 1;
+			for( pass=0 ; pass < 2 ; pass++ ) {
+				for( i=0 ; i < colours ; i++, c = (c+1 == colours) ? 0 : c+1 ) {
+					unsigned char j, same = 0, joined = 0;
+
+					if( pass == 0 && count[c+1] >= max ) continue;
+					for( j=0 ; j < n ; j++ ) {
+						if( cells[near[j]] == c+1 ) {
+							same += group[near[j]];
+							joined = near[j];
+						}
+					}
+					if( same < 2 ) {
+						cells[b] = c+1;
+						group[b] = same + 1;
+						if( same ) group[joined] = 2;
+						count[c+1]++;
+						break;
+					}
+				}
+				if( i < colours ) break;
+			}
+		}
+		above = b - width;
+	}
+
+	return total;
+}
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ *  Generates the aiming and trajectory tables for the game
+ *  Copyright (C) 2011  Steve Maddison
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Writes the per-angle tables used by draw_arrow() and update_projectile().
+ * Angle 0 points straight up and angle n is n/angles of the way to
+ * horizontal; negative angles use the same entries mirrored.
+ *
+ * Each aim_t entry holds the arrow tile frame followed by the offsets of
+ * the arrow, ring and rivet sprites from the pivot, so the arrow is drawn
+ * from one sequential read. Each traj_t entry is the projectile's step per
+ * tick in x and y, in 1/(1<<shift) pixels; TRAJ_STEP is its full length.
+ *
+ *   aimgen [-a angles] [-s shift] [-v speed] out.inc
+ *
+ * speed is in pixels per tick. With the default 30 angles the arrow
+ * offsets are the original hand-placed ones; the other tables, and the
+ * arrow for any other number of angles, are worked out from the radii
+ * below. The defaults give the original ring, rivet and trajectory tables.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX_ANGLES	127
+// proj.x and proj.y are 16 bit ints, and the field is 144 pixels tall.
+#define MAX_SHIFT	7
+
+// Distance of each part of the arrow from the pivot, in pixels.
+#define ARROW_RADIUS	27
+#define RING_RADIUS		20
+#define RIVET_RADIUS	14
+
+// The arrow has a tile for every 15 degrees. Where the point falls within
+// each tile differs, so each frame carries its own correction.
+#define ARROW_FRAMES	7
+const int frame_dx[ARROW_FRAMES] = { 0, 1, 1, 0, 0, 0, 1 };
+const int frame_dy[ARROW_FRAMES] = { 4, 4, 5, 4, 6, 6, 5 };
+
+// The arrow offsets as originally placed by hand for 30 angles. The
+// per-frame correction gets within a pixel of them, but steps back where
+// the frame changes.
+#define HAND_ANGLES	30
+const int hand_arrow_x[HAND_ANGLES] = {
+	 0,  1,  3,  5,  7,  8,  9, 10, 12, 13, 14, 15, 16, 17, 18,
+	19, 20, 21, 22, 23, 24, 24, 25, 25, 26, 26, 27, 27, 28, 28 };
+const int hand_arrow_y[HAND_ANGLES] = {
+	31, 31, 31, 31, 31, 30, 30, 30, 29, 29, 28, 28, 26, 26, 24,
+	23, 22, 22, 21, 20, 19, 18, 17, 15, 14, 13, 11, 10,  8,  6 };
+
+int nearest( double v ) {
+	return (int)floor( v + 0.5 );
+}
+
+int main( int argc, char *argv[] ) {
+	int angles = HAND_ANGLES, shift = 4, arg = 1, a, ax = 0, ay = 0;
+	double speed = 3.0;
+	FILE *f;
+
+	while( arg < argc && argv[arg][0] == '-' ) {
+		if( !strcmp( argv[arg], "-a" ) && arg+1 < argc ) angles = atoi( argv[++arg] );
+		else if( !strcmp( argv[arg], "-s" ) && arg+1 < argc ) shift = atoi( argv[++arg] );
+		else if( !strcmp( argv[arg], "-v" ) && arg+1 < argc ) speed = atof( argv[++arg] );
+		else break;
+		arg++;
+	}
+	if( argc - arg != 1 || angles < 2 || angles > MAX_ANGLES || shift < 0 || shift > MAX_SHIFT || speed <= 0 ) {
+		fprintf( stderr, "usage: aimgen [-a angles(2-%d)] [-s shift(0-%d)] [-v speed] out.inc\n", MAX_ANGLES, MAX_SHIFT );
+		return 1;
+	}
+	if( nearest( speed * (1 << shift) ) > 255 ) {
+		fprintf( stderr, "speed %g doesn't fit a byte with shift %d\n", speed, shift );
+		return 1;
+	}
+
+	f = fopen( argv[arg], "w" );
+	if( !f ) {
+		perror( argv[arg] );
+		return 1;
+	}
+
+	fprintf( f, "// Generated by aimgen -a %d -s %d -v %g, see draw_arrow().\n", angles, shift, speed );
+	fprintf( f, "#define ANGLES %d\n", angles );
+	fprintf( f, "#define TRAJ_SHIFT %d\n", shift );
+	fprintf( f, "#define TRAJ_STEP %d\n", nearest( speed * (1 << shift) ) );
+
+	fprintf( f, "const aim_t aim[ANGLES] PROGMEM = {\n" );
+	for( a=0 ; a < angles ; a++ ) {
+		double t = (M_PI/2) * a / angles;
+		int frame = nearest( (ARROW_FRAMES-1) * (double)a / angles );
+
+		if( angles == HAND_ANGLES ) {
+			ax = hand_arrow_x[a];
+			ay = hand_arrow_y[a];
+		}
+		else {
+			// Never let the correction move the arrow back against the
+			// turn, or it jitters by a pixel at frame changes.
+			int x = nearest( ARROW_RADIUS*sin( t ) ) + frame_dx[frame];
+			int y = nearest( ARROW_RADIUS*cos( t ) ) + frame_dy[frame];
+
+			if( a == 0 || x > ax ) ax = x;
+			if( a == 0 || y < ay ) ay = y;
+		}
+		fprintf( f, "\t{ %d, %2d,%2d, %2d,%2d, %2d,%2d }%s\n", frame, ax, ay,
+			nearest( RING_RADIUS*sin( t ) ), nearest( RING_RADIUS*cos( t ) ),
+			nearest( RIVET_RADIUS*sin( t ) ), nearest( RIVET_RADIUS*cos( t ) ),
+			a+1 < angles ? "," : " };" );
+	}
+
+	fprintf( f, "const traj_t traj[ANGLES] PROGMEM = {\n" );
+	for( a=0 ; a < angles ; a++ ) {
+		double t = (M_PI/2) * a / angles;
+		double step = speed * (1 << shift);
+
+		fprintf( f, "\t{ %3d,%3d }%s\n", nearest( step*sin( t ) ), nearest( step*cos( t ) ),
+			a+1 < angles ? "," : " };" );
+	}
+
+	fclose( f );
+	return 0;
+}
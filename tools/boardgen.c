@@ -0,0 +1,148 @@
+/*
+ *  Starting boards on the host, for checking and benchmarking
+ *  Copyright (C) 2011  Steve Maddison
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Runs the game's board generator for a range of seeds, printing each board
+ * as a C initialiser and checking it: every cell filled, no group of three
+ * or more, and no colour used more than its share.
+ *
+ *   boardgen [-r rows] [-c colours] [-q] seed [count]
+ *
+ * -q prints only the check results.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../board.h"
+
+#define MAX_ROWS 12
+
+unsigned char cells[BOARD_CELLS(MAX_ROWS)];
+unsigned char row_of[BOARD_CELLS(MAX_ROWS)];
+unsigned char column_of[BOARD_CELLS(MAX_ROWS)];
+int first_in_row[MAX_ROWS+1];
+
+int neighbour( int rows, int b, int dir ) {
+	// The six neighbours of b, or -1 off the board.
+	int row = row_of[b], column = column_of[b], r = row, c = column;
+	int odd = row & 1;
+
+	switch( dir ) {
+		case 0: c--; break;
+		case 1: c++; break;
+		case 2: r--; c += odd ? 0 : -1; break;
+		case 3: r--; c += odd ? 1 : 0; break;
+		case 4: r++; c += odd ? 0 : -1; break;
+		case 5: r++; c += odd ? 1 : 0; break;
+	}
+	if( r < 0 || r >= rows || c < 0 ) return -1;
+	if( c >= ((r & 1) ? BOARD_WIDE-1 : BOARD_WIDE) ) return -1;
+	return first_in_row[r] + c;
+}
+
+int group_size( int rows, int b, unsigned char *seen ) {
+	int dir, n, size = 1;
+
+	seen[b] = 1;
+	for( dir=0 ; dir < 6 ; dir++ ) {
+		n = neighbour( rows, b, dir );
+		if( n >= 0 && !seen[n] && cells[n] == cells[b] ) {
+			size += group_size( rows, n, seen );
+		}
+	}
+	return size;
+}
+
+int check( int rows, int colours, int total ) {
+	unsigned char seen[BOARD_CELLS(MAX_ROWS)];
+	int count[BOARD_MAX_COLOURS+1];
+	int b, size, biggest = 0, errors = 0;
+
+	memset( count, 0, sizeof(count) );
+	for( b=0 ; b < total ; b++ ) {
+		if( cells[b] < 1 || cells[b] > colours ) {
+			printf( "  cell %d empty or out of range\n", b );
+			errors++;
+		}
+		else {
+			count[cells[b]]++;
+		}
+		memset( seen, 0, sizeof(seen) );
+		size = group_size( rows, b, seen );
+		if( size > biggest ) biggest = size;
+	}
+	if( biggest >= 3 ) {
+		printf( "  group of %d\n", biggest );
+		errors++;
+	}
+	for( b=1 ; b <= colours ; b++ ) {
+		if( count[b] > BOARD_COLOUR_MAX( total, colours ) ) {
+			printf( "  colour %d used %d times\n", b, count[b] );
+			errors++;
+		}
+	}
+	return errors;
+}
+
+int main( int argc, char *argv[] ) {
+	int rows = 5, colours = 7, quiet = 0, arg = 1;
+	int r, b, n, count = 1, total, failed = 0;
+	unsigned long seed;
+
+	while( arg < argc && argv[arg][0] == '-' ) {
+		if( !strcmp( argv[arg], "-r" ) && arg+1 < argc ) rows = atoi( argv[++arg] );
+		else if( !strcmp( argv[arg], "-c" ) && arg+1 < argc ) colours = atoi( argv[++arg] );
+		else if( !strcmp( argv[arg], "-q" ) ) quiet = 1;
+		else break;
+		arg++;
+	}
+	if( arg >= argc || rows < 1 || rows > MAX_ROWS || colours < 1 || colours > BOARD_MAX_COLOURS ) {
+		fprintf( stderr, "usage: boardgen [-r rows] [-c colours] [-q] seed [count]\n" );
+		return 1;
+	}
+	seed = strtoul( argv[arg], NULL, 0 );
+	if( arg+1 < argc ) count = atoi( argv[arg+1] );
+
+	for( r=0, b=0 ; r < rows ; r++ ) {
+		first_in_row[r] = b;
+		for( n=0 ; n < ((r & 1) ? BOARD_WIDE-1 : BOARD_WIDE) ; n++, b++ ) {
+			row_of[b] = r;
+			column_of[b] = n;
+		}
+	}
+
+	for( n=0 ; n < count ; n++, seed++ ) {
+		int errors;
+
+		total = board_generate( cells, rows, colours, (uint32_t)seed );
+		errors = check( rows, colours, total );
+		failed += errors ? 1 : 0;
+		if( quiet && !errors ) continue;
+
+		printf( "// seed 0x%08lx%s\n{", seed, errors ? ", FAILED" : "" );
+		for( b=0 ; b < total ; b++ ) {
+			printf( "%d", cells[b] );
+			if( b+1 < total ) printf( (b+1 == first_in_row[row_of[b]+1]) ? ",\n" : "," );
+		}
+		printf( "},\n" );
+	}
+
+	fprintf( stderr, "%d of %d boards failed\n", failed, count );
+	return failed ? 1 : 0;
+}
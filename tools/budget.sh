@@ -0,0 +1,163 @@
+#!/bin/sh
+#
+#  Flash and SRAM budget report
+#  Copyright (C) 2011  Steve Maddison
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+#
+# Breaks flash and SRAM use down by object file (from the linker map), by
+# asset (symbols defined in data/*.inc) and by global, and prints each next
+# to its change from a stored baseline.
+#
+#   budget.sh game.map game.elf current.budget [baseline.budget]
+#
+# The current figures are written to current.budget, one "key flash ram"
+# line each; copy it over the baseline to accept them.
+#
+
+MAP=$1
+ELF=$2
+OUT=$3
+BASE=$4
+NM=${NM:-avr-nm}
+TOP=${TOP:-25}
+
+if [ ! -f "$MAP" ] || [ ! -f "$ELF" ] || [ -z "$OUT" ]; then
+	echo "usage: $0 game.map game.elf current.budget [baseline.budget]" >&2
+	exit 1
+fi
+[ -f "$BASE" ] || BASE=
+
+{
+	# Input sections from the linker map, summed per object file. Long
+	# section names push the address, size and file onto the next line.
+	awk '
+	function add( sect, size, file ) {
+		if( size == 0 || file == "" ) return
+		sub( /\(.*\)$/, "", file )	# libgcc.a(_mulsi3.o) -> libgcc.a
+		sub( /.*\//, "", file )
+		if( sect ~ /^\.(data|rodata)/ ) { flash[file] += size; ram[file] += size }
+		else if( sect ~ /^(\.bss|\.noinit|COMMON)/ ) ram[file] += size
+		else if( sect ~ /^\.eeprom/ ) return
+		else flash[file] += size
+		seen[file] = 1
+	}
+	function hex( s,    i, n, c ) {
+		n = 0
+		s = tolower( substr( s, 3 ) )
+		for( i=1 ; i <= length( s ) ; i++ ) {
+			c = index( "0123456789abcdef", substr( s, i, 1 ) )
+			n = n*16 + c - 1
+		}
+		return n
+	}
+	/^Linker script and memory map/ { inmap = 1; next }
+	!inmap { next }
+	pending != "" {
+		if( $1 ~ /^0x/ && NF >= 3 ) add( pending, hex( $2 ), $3 )
+		pending = ""
+		next
+	}
+	/^ \.[^ ]+$/ { pending = $1; next }
+	/^ (\.[^ ]+|COMMON) +0x/ && NF >= 4 { add( $1, hex( $3 ), $4 ) }
+	END {
+		for( f in seen ) printf "object:%s %d %d\n", f, flash[f], ram[f]
+	}' "$MAP"
+
+	# Symbols, with the source line they came from. SRAM addresses carry
+	# an 0x800000 offset; initialised data also costs its copy in flash.
+	$NM -S -l -t d "$ELF" | awk '
+	NF >= 4 && $2 ~ /^[0-9]+$/ {
+		addr = $1 + 0; size = $2 + 0; type = $3; name = $4
+		if( size == 0 || addr >= 8454144 ) next	# none, or EEPROM
+		src = (NF >= 5) ? $5 : ""
+		sub( /:[0-9]+$/, "", src )
+		if( addr >= 8388608 ) {
+			r = size
+			f = (type == "d" || type == "D") ? size : 0
+		}
+		else {
+			r = 0
+			f = size
+		}
+		if( src ~ /data\/[^\/]+\.inc$/ ) {
+			sub( /.*\//, "", src )
+			aflash[src] += f; aram[src] += r
+		}
+		printf "symbol:%s %d %d\n", name, f, r
+	}
+	END {
+		for( a in aflash ) printf "asset:%s %d %d\n", a, aflash[a], aram[a]
+	}'
+} | sort > "$OUT"
+
+# Report: objects and assets in full, then the largest globals along with
+# any that changed. Anything in the baseline but no longer built is shown
+# with its negative delta.
+awk -v base="$BASE" -v top="$TOP" '
+function delta( n ) { return (base != "" && n) ? sprintf( "(%+d)", n ) : "" }
+function row( key,    name ) {
+	name = key
+	sub( /^[a-z]+:/, "", name )
+	printf "  %-28s %7d %-8s %6d %-8s\n", name, flash[key], delta( flash[key] - bflash[key] ), ram[key], delta( ram[key] - bram[key] )
+}
+function keep( key ) {
+	if( key in seen ) return
+	seen[key] = 1
+	n++; keys[n] = key
+}
+BEGIN {
+	if( base != "" ) {
+		while( (getline line < base) > 0 ) {
+			split( line, w, " " )
+			bflash[w[1]] = w[2]; bram[w[1]] = w[3]
+		}
+	}
+}
+{
+	flash[$1] = $2; ram[$1] = $3
+	keep( $1 )
+}
+END {
+	for( k in bflash ) keep( k )
+	for( i=1 ; i <= n ; i++ ) {
+		k = keys[i]
+		if( k ~ /^object:/ ) {
+			tflash += flash[k]; tram += ram[k]
+			bt_flash += bflash[k]; bt_ram += bram[k]
+		}
+	}
+
+	printf "  %-28s %16s %15s\n", "", "flash", "sram"
+	print "Objects"
+	for( i=1 ; i <= n ; i++ ) if( keys[i] ~ /^object:/ ) row( keys[i] )
+	printf "  %-28s %7d %-8s %6d %-8s\n", "total", tflash, delta( tflash - bt_flash ), tram, delta( tram - bt_ram )
+	print "Assets"
+	for( i=1 ; i <= n ; i++ ) if( keys[i] ~ /^asset:/ ) row( keys[i] )
+
+	# Globals, largest combined cost first.
+	for( i=1 ; i <= n ; i++ ) if( keys[i] ~ /^symbol:/ ) sym[++nsym] = keys[i]
+	for( i=2 ; i <= nsym ; i++ ) {
+		k = sym[i]
+		for( j=i ; j > 1 && flash[sym[j-1]]+ram[sym[j-1]] < flash[k]+ram[k] ; j-- ) sym[j] = sym[j-1]
+		sym[j] = k
+	}
+	print "Globals"
+	for( i=1 ; i <= nsym ; i++ ) {
+		k = sym[i]
+		if( i <= top || (base != "" && (flash[k] != bflash[k] || ram[k] != bram[k])) ) row( k )
+	}
+}' "$OUT"
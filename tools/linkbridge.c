@@ -0,0 +1,112 @@
+/*
+ *  Serial link stand-in for testing linked play on one machine
+ *  Copyright (C) 2011  Steve Maddison
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Creates two pseudo-terminals and passes bytes between them, optionally
+ * holding each byte back for a while to mimic a slow link. Attach the UART
+ * of each emulator instance to one of the devices printed at startup.
+ *
+ *   linkbridge [delay_ms]
+ */
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/time.h>
+
+#define QUEUE_SIZE 4096
+
+typedef struct {
+	unsigned char data[QUEUE_SIZE];
+	long long due[QUEUE_SIZE];
+	int head;
+	int tail;
+} queue_t;
+
+long long now_ms( void ) {
+	struct timeval tv;
+
+	gettimeofday( &tv, NULL );
+	return ((long long)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+int open_pty( void ) {
+	struct termios tio;
+	int fd = posix_openpt( O_RDWR | O_NOCTTY );
+
+	if( fd < 0 || grantpt( fd ) < 0 || unlockpt( fd ) < 0 ) {
+		perror( "posix_openpt" );
+		exit( 1 );
+	}
+	// Raw bytes, no echo or line editing.
+	tcgetattr( fd, &tio );
+	cfmakeraw( &tio );
+	tcsetattr( fd, TCSANOW, &tio );
+	printf( "%s\n", ptsname( fd ) );
+	return fd;
+}
+
+void receive( int fd, queue_t *q, int delay ) {
+	unsigned char buf[256];
+	int i, n = read( fd, buf, sizeof(buf) );
+
+	for( i=0 ; i < n ; i++ ) {
+		int next = (q->tail + 1) % QUEUE_SIZE;
+		if( next == q->head ) break; // Full, drop it like a real link would.
+		q->data[q->tail] = buf[i];
+		q->due[q->tail] = now_ms() + delay;
+		q->tail = next;
+	}
+}
+
+void deliver( int fd, queue_t *q ) {
+	long long t = now_ms();
+
+	while( q->head != q->tail && q->due[q->head] <= t ) {
+		if( write( fd, &q->data[q->head], 1 ) != 1 ) break;
+		q->head = (q->head + 1) % QUEUE_SIZE;
+	}
+}
+
+int main( int argc, char *argv[] ) {
+	static queue_t a_to_b, b_to_a;
+	struct pollfd fds[2];
+	int delay = 0;
+
+	if( argc > 1 ) delay = atoi( argv[1] );
+
+	fds[0].fd = open_pty();
+	fds[1].fd = open_pty();
+	fflush( stdout );
+	fds[0].events = fds[1].events = POLLIN;
+
+	while( 1 ) {
+		poll( fds, 2, 1 );
+		if( fds[0].revents & POLLIN ) receive( fds[0].fd, &a_to_b, delay );
+		if( fds[1].revents & POLLIN ) receive( fds[1].fd, &b_to_a, delay );
+		deliver( fds[1].fd, &a_to_b );
+		deliver( fds[0].fd, &b_to_a );
+	}
+
+	return 0;
+}
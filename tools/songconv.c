@@ -0,0 +1,364 @@
+/*
+ *  Converts kernel MIDI song streams to the game's compact music format
+ *  Copyright (C) 2011  Steve Maddison
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Reads a song as written by the kernel's midiconv (a C array of single
+ * track MIDI events with delta times) and writes it out in the format
+ * played by song_tick() in the game:
+ *
+ *   0cchwwww note n     Note on channel c, note byte follows, then a
+ *                       velocity byte if h is set (otherwise the channel's
+ *                       last velocity is used). Then waits w ticks (0-15)
+ *                       before the next event.
+ *   10wwwwww            Wait w ticks (1-63).
+ *   1100cccc patch      Program change.
+ *   11010000 lo hi len  Play len bytes from offset hi:lo, then carry on.
+ *   11100000            Loop start.
+ *   11100001            Loop end, jump back to loop start.
+ *   11111111            End of song.
+ *
+ * Delta times are folded into the events, running status and meta events
+ * go away, and repeated runs of events are replaced by calls to their
+ * first occurrence. Volume and expression controllers are folded into the
+ * note velocities; other controllers are dropped.
+ *
+ *   songconv [-q ticks] in.inc out.inc name
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_BYTES	65536
+#define MAX_UNITS	8192
+#define CHANNELS	4
+
+#define SONG_WAIT		0x80
+#define SONG_PATCH		0xc0
+#define SONG_CALL		0xd0
+#define SONG_LOOP_START	0xe0
+#define SONG_LOOP_END	0xe1
+#define SONG_END		0xff
+
+#define CALL_SIZE	4
+#define MAX_WAIT	63
+
+enum { EV_NOTE, EV_PATCH, EV_LOOP_START, EV_LOOP_END, EV_END };
+
+typedef struct {
+	long time;
+	int type;
+	int channel;
+	int note;
+	int velocity;
+} event_t;
+
+// An encoded piece of the output, the smallest thing a call can cover.
+typedef struct {
+	unsigned char data[4];
+	int len;
+	// Channel velocities before this unit, as the player will see them.
+	unsigned char velocity[CHANNELS];
+	int marker;
+} unit_t;
+
+unsigned char in[MAX_BYTES];
+int in_len;
+event_t events[MAX_UNITS];
+int num_events;
+unit_t units[MAX_UNITS];
+int num_units;
+
+int read_inc( const char *path ) {
+	// Pick up every 0xNN after the opening brace.
+	FILE *f = fopen( path, "r" );
+	int c, started = 0;
+	unsigned int byte;
+
+	if( !f ) {
+		perror( path );
+		return -1;
+	}
+	while( (c = fgetc( f )) != EOF ) {
+		if( c == '{' ) started = 1;
+		if( started && c == '0' ) {
+			c = fgetc( f );
+			if( (c == 'x' || c == 'X') && fscanf( f, "%2x", &byte ) == 1 ) {
+				if( in_len == MAX_BYTES ) break;
+				in[in_len++] = byte;
+			}
+		}
+	}
+	fclose( f );
+	return in_len;
+}
+
+void add_event( long time, int type, int channel, int note, int velocity ) {
+	event_t *e;
+
+	if( num_events == MAX_UNITS ) {
+		fprintf( stderr, "too many events\n" );
+		exit( 1 );
+	}
+	e = &events[num_events++];
+	e->time = time;
+	e->type = type;
+	e->channel = channel;
+	e->note = note;
+	e->velocity = velocity;
+}
+
+int parse( void ) {
+	int pos = 0, status = 0, channel, c1, c2, dropped = 0;
+	int volume[16], expression[16];
+	long time = 0, delta;
+
+	for( channel=0 ; channel < 16 ; channel++ ) {
+		volume[channel] = expression[channel] = 127;
+	}
+
+	while( pos < in_len ) {
+		delta = 0;
+		do {
+			c1 = in[pos++];
+			delta = (delta << 7) | (c1 & 0x7f);
+		} while( (c1 & 0x80) && pos < in_len );
+		time += delta;
+
+		c1 = in[pos++];
+		if( c1 == 0xff ) {
+			c1 = in[pos++];
+			if( c1 == 0x2f ) {
+				add_event( time, EV_END, 0, 0, 0 );
+				break;
+			}
+			c2 = in[pos++]; // Length
+			if( c1 == 0x06 && c2 == 1 ) {
+				if( in[pos] == 'S' ) add_event( time, EV_LOOP_START, 0, 0, 0 );
+				if( in[pos] == 'E' ) add_event( time, EV_LOOP_END, 0, 0, 0 );
+			}
+			pos += c2;
+			continue;
+		}
+		if( c1 & 0x80 ) {
+			status = c1;
+			c1 = in[pos++];
+		}
+		channel = status & 0x0f;
+
+		switch( status & 0xf0 ) {
+			case 0x90:
+				c2 = in[pos++];
+				if( channel >= CHANNELS ) {
+					fprintf( stderr, "note on channel %d not supported\n", channel );
+					return -1;
+				}
+				c2 = (c2 * volume[channel] * expression[channel]) / (127*127);
+				add_event( time, EV_NOTE, channel, c1, c2 );
+				break;
+			case 0xb0:
+				c2 = in[pos++];
+				if( c1 == 7 ) volume[channel] = c2;
+				else if( c1 == 11 ) expression[channel] = c2;
+				else dropped++;
+				break;
+			case 0xc0:
+				if( channel >= CHANNELS ) {
+					fprintf( stderr, "program change on channel %d not supported\n", channel );
+					return -1;
+				}
+				add_event( time, EV_PATCH, channel, c1, 0 );
+				break;
+			default:
+				fprintf( stderr, "unknown status 0x%02x at %d\n", status, pos );
+				return -1;
+		}
+	}
+
+	if( dropped ) fprintf( stderr, "dropped %d controller events\n", dropped );
+	return num_events;
+}
+
+unit_t *new_unit( const unsigned char *velocity ) {
+	unit_t *u;
+
+	if( num_units == MAX_UNITS ) {
+		fprintf( stderr, "too many units\n" );
+		exit( 1 );
+	}
+	u = &units[num_units++];
+	memset( u, 0, sizeof(*u) );
+	memcpy( u->velocity, velocity, CHANNELS );
+	return u;
+}
+
+void encode( int quantise ) {
+	unsigned char velocity[CHANNELS];
+	int i;
+	long wait, prev = 0;
+	unit_t *u;
+
+	memset( velocity, 0, sizeof(velocity) );
+	for( i=0 ; i < num_events ; i++ ) {
+		events[i].time = ((events[i].time + quantise/2) / quantise) * quantise;
+	}
+
+	// Anything before the first event.
+	if( num_events ) prev = events[0].time;
+	for( wait = prev ; wait > 0 ; wait -= MAX_WAIT ) {
+		u = new_unit( velocity );
+		u->data[u->len++] = SONG_WAIT | (wait > MAX_WAIT ? MAX_WAIT : wait);
+	}
+
+	for( i=0 ; i < num_events ; i++ ) {
+		event_t *e = &events[i];
+
+		wait = (i+1 < num_events) ? events[i+1].time - e->time : 0;
+		u = new_unit( velocity );
+		switch( e->type ) {
+			case EV_NOTE:
+				u->data[0] = (e->channel << 5) | (wait > 15 ? 15 : wait);
+				u->data[1] = e->note;
+				u->len = 2;
+				if( e->velocity != velocity[e->channel] ) {
+					u->data[0] |= 0x10;
+					u->data[u->len++] = e->velocity;
+					velocity[e->channel] = e->velocity;
+				}
+				wait -= (wait > 15) ? 15 : wait;
+				break;
+			case EV_PATCH:
+				u->data[u->len++] = SONG_PATCH | e->channel;
+				u->data[u->len++] = e->note;
+				break;
+			case EV_LOOP_START:
+				u->data[u->len++] = SONG_LOOP_START;
+				u->marker = 1;
+				// Coming round again the velocities are whatever the end of
+				// the loop left, so every channel has to set its own again.
+				memset( velocity, 0xff, sizeof(velocity) );
+				break;
+			case EV_LOOP_END:
+				// The jump makes anything after it unreachable, bar the end.
+				u->data[u->len++] = SONG_LOOP_END;
+				u->marker = 1;
+				wait = 0;
+				break;
+			case EV_END:
+				u->data[u->len++] = SONG_END;
+				u->marker = 1;
+				wait = 0;
+				break;
+		}
+		for( ; wait > 0 ; wait -= MAX_WAIT ) {
+			u = new_unit( velocity );
+			u->data[u->len++] = SONG_WAIT | (wait > MAX_WAIT ? MAX_WAIT : wait);
+		}
+	}
+}
+
+int compress( unsigned char *out ) {
+	// Greedy: at each unit, call the longest earlier literal run that
+	// matches, as long as that saves something.
+	static int offset[MAX_UNITS];
+	int i, j, k, len = 0, calls = 0;
+
+	for( i=0 ; i < num_units ; ) {
+		int best_j = -1, best_units = 0, best_bytes = 0;
+
+		for( j=0 ; j < i ; j++ ) {
+			int bytes = 0;
+
+			// The player's velocities have to agree on the way in.
+			if( memcmp( units[j].velocity, units[i].velocity, CHANNELS ) ) continue;
+			for( k=0 ; j+k < i && i+k < num_units ; k++ ) {
+				if( offset[j+k] < 0 || units[j+k].marker || units[i+k].marker ) break;
+				if( bytes + units[j+k].len > 255 ) break;
+				if( units[j+k].len != units[i+k].len ) break;
+				if( memcmp( units[j+k].data, units[i+k].data, units[i+k].len ) ) break;
+				bytes += units[j+k].len;
+				if( bytes > best_bytes ) {
+					best_j = j;
+					best_units = k+1;
+					best_bytes = bytes;
+				}
+			}
+		}
+
+		if( best_bytes > CALL_SIZE ) {
+			for( k=0 ; k < best_units ; k++ ) offset[i+k] = -1;
+			out[len++] = SONG_CALL;
+			out[len++] = offset[best_j] & 0xff;
+			out[len++] = offset[best_j] >> 8;
+			out[len++] = best_bytes;
+			i += best_units;
+			calls++;
+		}
+		else {
+			offset[i] = len;
+			memcpy( out+len, units[i].data, units[i].len );
+			len += units[i].len;
+			i++;
+		}
+		if( len > 0xffff ) {
+			fprintf( stderr, "song too long\n" );
+			exit( 1 );
+		}
+	}
+
+	fprintf( stderr, "%d bytes in, %d units, %d calls, %d bytes out\n", in_len, num_units, calls, len );
+	return len;
+}
+
+int write_inc( const char *path, const char *name, const char *source, const unsigned char *data, int len ) {
+	FILE *f = fopen( path, "w" );
+	const char *base = strrchr( source, '/' );
+	int i;
+
+	if( !f ) {
+		perror( path );
+		return -1;
+	}
+	fprintf( f, "// Generated from %s by songconv, see song_tick().\n", base ? base+1 : source );
+	fprintf( f, "const char %s[] PROGMEM ={\n", name );
+	for( i=0 ; i < len ; i++ ) {
+		fprintf( f, "0x%02x%s", data[i], i+1 == len ? " };\n" : ((i & 31) == 31 ? ",\n" : ",") );
+	}
+	fclose( f );
+	return 0;
+}
+
+int main( int argc, char *argv[] ) {
+	static unsigned char out[MAX_BYTES*2];
+	int quantise = 1, arg = 1, len;
+
+	if( argc > 2 && !strcmp( argv[1], "-q" ) ) {
+		quantise = atoi( argv[2] );
+		arg = 3;
+	}
+	if( argc - arg != 3 || quantise < 1 ) {
+		fprintf( stderr, "usage: songconv [-q ticks] in.inc out.inc name\n" );
+		return 1;
+	}
+
+	if( read_inc( argv[arg] ) <= 0 || parse() <= 0 ) return 1;
+	encode( quantise );
+	len = compress( out );
+
+	return write_inc( argv[arg+1], argv[arg+2], argv[arg], out, len ) ? 1 : 0;
+}